@@ -1,10 +1,80 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <climits>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iomanip>
+#include <iterator>
 #include <chrono>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "chip8_vecenv.h"
+
+#if !defined(CHIP8_HEADLESS)
 #include <SDL2/SDL.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP8_POSIX 1
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) && defined(CHIP8_POSIX)
+#define CHIP8_JIT 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 const unsigned int START_ADDRESS = 0x200;
+const unsigned int MAX_ROM_SIZE = 4096 - START_ADDRESS;
+
+//Why a ROM file could not be loaded
+enum RomError : uint8_t {
+  ROM_OK,
+  ROM_MISSING,     //Cannot be opened
+  ROM_NOT_REGULAR, //A FIFO, device or directory, with no size to read or map
+  ROM_TOO_BIG,     //More than MAX_ROM_SIZE bytes
+  ROM_SHORT_READ   //Fewer bytes came in than the file holds
+};
+
+//What went wrong, worded to follow the ROM's filename in a message
+inline char const* RomErrorText(RomError error) {
+  switch (error) {
+    case ROM_OK:
+      return "loaded";
+    case ROM_MISSING:
+      return "cannot be opened";
+    case ROM_NOT_REGULAR:
+      return "is not a regular file";
+    case ROM_TOO_BIG:
+      return "is too big to fit in memory above 0x200";
+    case ROM_SHORT_READ:
+      return "could not be read whole";
+  }
+  return "cannot be loaded";
+}
 const unsigned int FONTSET_START_ADDRESS = 0x50;
 const unsigned int FONTSET_SIZE = 80;
 const unsigned int VIDEO_HEIGHT = 32;
@@ -31,30 +101,476 @@ uint8_t fontset[FONTSET_SIZE] =
   0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+//Every instruction handler, in handler id order; those whose behaviour
+//depends on the quirk profile are passed to Q instead of X
+#define CHIP8_OPS_QUIRKED(X, Q) \
+  X(NULL) X(00E0) X(00EE) X(1nnn) X(2nnn) X(3xkk) X(4xkk) X(5xy0) \
+  X(6xkk) X(7xkk) X(8xy0) Q(8xy1) Q(8xy2) Q(8xy3) X(8xy4) X(8xy5) \
+  Q(8xy6) X(8xy7) Q(8xyE) X(9xy0) X(Annn) Q(Bnnn) X(Cxkk) Q(Dxyn) \
+  X(Ex9E) X(ExA1) X(Fx07) X(Fx0A) X(Fx15) X(Fx18) X(Fx1E) X(Fx29) \
+  X(Fx33) Q(Fx55) Q(Fx65)
+
+#define CHIP8_OPS(X) CHIP8_OPS_QUIRKED(X, X)
+
+/**
+ * Superinstructions: runs of consecutive instructions the threaded
+ * interpreter executes with one dispatch, each given by its handlers and
+ * how to call them. Only the last instruction of a run may write memory.
+ * Triples are matched before pairs. Regenerate from a ROM corpus with
+ * --mine.
+ */
+#define CHIP8_FUSED_TRIPLES(X) \
+  X(Fx07, 3xkk, 1nnn, OP_Fx07(), OP_3xkk(), OP_1nnn())
+
+#define CHIP8_FUSED_PAIRS(X) \
+  X(Annn, Dxyn, OP_Annn(), OP_Dxyn<Q>()) \
+  X(6xkk, 6xkk, OP_6xkk(), OP_6xkk()) \
+  X(7xkk, 3xkk, OP_7xkk(), OP_3xkk()) \
+  X(7xkk, 4xkk, OP_7xkk(), OP_4xkk())
+
+//Handler ids, used to index the threaded interpreter's jump table
+enum OpId : uint8_t {
+#define CHIP8_OP_ID(name) ID_##name,
+  CHIP8_OPS(CHIP8_OP_ID)
+#undef CHIP8_OP_ID
+  ID_COUNT,
+
+  //Marks a predecode cache entry that must be decoded before use
+  ID_UNDECODED = ID_COUNT,
+
+  //Superinstructions, the ids the predecoder gives the first instruction of a run
+#define CHIP8_TRIPLE_ID(a, b, c, callA, callB, callC) ID_##a##_##b##_##c,
+#define CHIP8_PAIR_ID(a, b, callA, callB) ID_##a##_##b,
+  CHIP8_FUSED_TRIPLES(CHIP8_TRIPLE_ID)
+  CHIP8_FUSED_PAIRS(CHIP8_PAIR_ID)
+#undef CHIP8_PAIR_ID
+#undef CHIP8_TRIPLE_ID
+  ID_FUSED_END
+};
+
+//Bytes of memory a predecoded entry can depend on: a triple's three instructions
+const unsigned int MAX_FUSED_BYTES = 6;
+
+/**
+ * Resolves an opcode to its handler id: the top nibble picks a group, and
+ * in the 0, 8, E and F groups the low nibble or byte picks within it.
+ */
+constexpr uint8_t DecodeOpId(uint16_t opcode) {
+  switch (opcode >> 12u) {
+    case 0x0:
+      switch (opcode & 0x000Fu) {
+        case 0x0: return ID_00E0;
+        case 0xE: return ID_00EE;
+        default: return ID_NULL;
+      }
+    case 0x1: return ID_1nnn;
+    case 0x2: return ID_2nnn;
+    case 0x3: return ID_3xkk;
+    case 0x4: return ID_4xkk;
+    case 0x5: return ID_5xy0;
+    case 0x6: return ID_6xkk;
+    case 0x7: return ID_7xkk;
+    case 0x8:
+      switch (opcode & 0x000Fu) {
+        case 0x0: return ID_8xy0;
+        case 0x1: return ID_8xy1;
+        case 0x2: return ID_8xy2;
+        case 0x3: return ID_8xy3;
+        case 0x4: return ID_8xy4;
+        case 0x5: return ID_8xy5;
+        case 0x6: return ID_8xy6;
+        case 0x7: return ID_8xy7;
+        case 0xE: return ID_8xyE;
+        default: return ID_NULL;
+      }
+    case 0x9: return ID_9xy0;
+    case 0xA: return ID_Annn;
+    case 0xB: return ID_Bnnn;
+    case 0xC: return ID_Cxkk;
+    case 0xD: return ID_Dxyn;
+    case 0xE:
+      switch (opcode & 0x000Fu) {
+        case 0x1: return ID_ExA1;
+        case 0xE: return ID_Ex9E;
+        default: return ID_NULL;
+      }
+    default:
+      switch (opcode & 0x00FFu) {
+        case 0x07: return ID_Fx07;
+        case 0x0A: return ID_Fx0A;
+        case 0x15: return ID_Fx15;
+        case 0x18: return ID_Fx18;
+        case 0x1E: return ID_Fx1E;
+        case 0x29: return ID_Fx29;
+        case 0x33: return ID_Fx33;
+        case 0x55: return ID_Fx55;
+        case 0x65: return ID_Fx65;
+        default: return ID_NULL;
+      }
+  }
+}
+
+//Only the top nibble and the low byte select a handler
+constexpr uint16_t OpIdKey(uint16_t opcode) {
+  return ((opcode & 0xF000u) >> 4u) | (opcode & 0x00FFu);
+}
+
+//Handler id for every OpIdKey, so decoding is a single load
+struct OpIdTable {
+  uint8_t ids[4096];
+
+  constexpr OpIdTable() : ids() {
+    for (unsigned int key = 0; key < 4096; ++key) {
+      ids[key] = DecodeOpId(((key & 0xF00u) << 4u) | (key & 0x0FFu));
+    }
+  }
+};
+
+constexpr OpIdTable opIdTable;
+
+//An instruction with its handler id and operands already extracted
+struct Instruction {
+  uint16_t nnn;
+  uint8_t id;
+  uint8_t x;
+  uint8_t y;
+  uint8_t kk;
+  uint8_t n;
+};
+
+constexpr Instruction DecodeInstruction(uint16_t opcode) {
+  return Instruction{
+    static_cast<uint16_t>(opcode & 0x0FFFu),
+    opIdTable.ids[OpIdKey(opcode)],
+    static_cast<uint8_t>((opcode & 0x0F00u) >> 8u),
+    static_cast<uint8_t>((opcode & 0x00F0u) >> 4u),
+    static_cast<uint8_t>(opcode & 0x00FFu),
+    static_cast<uint8_t>(opcode & 0x000Fu)
+  };
+}
+
+//Handler id of the instruction at address in memory
+inline uint8_t OpIdAt(const uint8_t* memory, unsigned int address) {
+  return opIdTable.ids[OpIdKey((memory[address] << 8u) | memory[address + 1])];
+}
+
+//First handler of each superinstruction, in id order after ID_UNDECODED
+constexpr uint8_t fusedFirstIds[ID_FUSED_END - ID_UNDECODED - 1] = {
+#define CHIP8_TRIPLE_FIRST(a, b, c, callA, callB, callC) ID_##a,
+#define CHIP8_PAIR_FIRST(a, b, callA, callB) ID_##a,
+  CHIP8_FUSED_TRIPLES(CHIP8_TRIPLE_FIRST)
+  CHIP8_FUSED_PAIRS(CHIP8_PAIR_FIRST)
+#undef CHIP8_PAIR_FIRST
+#undef CHIP8_TRIPLE_FIRST
+};
+
+//The handler of an entry's own instruction, whether or not it starts a superinstruction
+constexpr uint8_t BaseOpId(uint8_t id) {
+  return id > ID_UNDECODED ? fusedFirstIds[id - ID_UNDECODED - 1] : id;
+}
+
+/**
+ * Decodes the instruction at address in memory for the predecode cache,
+ * with a superinstruction id if a fused run starts there. The entry
+ * depends on up to MAX_FUSED_BYTES of memory from address; a run never
+ * crosses into the next 256-byte page of the cache. Memory wraps, so the
+ * instruction at the last address ends with the first byte.
+ */
+inline Instruction PredecodeInstruction(const uint8_t* memory, unsigned int address) {
+  Instruction instr = DecodeInstruction((memory[address] << 8u) | memory[(address + 1) & 0xFFFu]);
+
+  if ((address & 0xFFu) + 5 < 256) {
+    uint8_t second = OpIdAt(memory, address + 2);
+    uint8_t third = OpIdAt(memory, address + 4);
+#define CHIP8_TRIPLE_MATCH(a, b, c, callA, callB, callC) \
+    if (instr.id == ID_##a && second == ID_##b && third == ID_##c) { \
+      instr.id = ID_##a##_##b##_##c; \
+      return instr; \
+    }
+    CHIP8_FUSED_TRIPLES(CHIP8_TRIPLE_MATCH)
+#undef CHIP8_TRIPLE_MATCH
+    (void)third;
+  }
+
+  if ((address & 0xFFu) + 3 < 256) {
+    uint8_t second = OpIdAt(memory, address + 2);
+#define CHIP8_PAIR_MATCH(a, b, callA, callB) \
+    if (instr.id == ID_##a && second == ID_##b) { \
+      instr.id = ID_##a##_##b; \
+      return instr; \
+    }
+    CHIP8_FUSED_PAIRS(CHIP8_PAIR_MATCH)
+#undef CHIP8_PAIR_MATCH
+  }
+
+  return instr;
+}
+
+/**
+ * Behaviour that differs between CHIP-8 interpreters. A profile is a
+ * template argument of the interpreter loop and of the handlers listed
+ * as quirked in CHIP8_OPS_QUIRKED, so each profile gets its own loop and
+ * its choices are folded away at compile time.
+ *
+ * DefaultQuirks is what this emulator has always done; the others follow
+ * the original COSMAC VIP interpreter, SUPER-CHIP 1.1 and XO-CHIP (Octo).
+ */
+struct DefaultQuirks {
+  static const bool LOGIC_RESETS_VF = false;    //8xy1/8xy2/8xy3 clear VF
+  static const bool SHIFT_USES_VY = true;       //8xy6/8xyE shift Vy into Vx, rather than Vx in place
+  static const bool LOAD_STORE_MOVES_I = false; //Fx55/Fx65 leave I past the last register
+  static const bool JUMP_USES_VX = false;       //Bxnn jumps to xnn + Vx, rather than nnn + V0
+  static const bool SPRITES_WRAP = false;       //Dxyn wraps at the edges, rather than clipping
+};
+
+struct CosmacQuirks : DefaultQuirks {
+  static const bool LOGIC_RESETS_VF = true;
+  static const bool LOAD_STORE_MOVES_I = true;
+};
+
+struct SchipQuirks : DefaultQuirks {
+  static const bool SHIFT_USES_VY = false;
+  static const bool JUMP_USES_VX = true;
+};
+
+struct XoChipQuirks : DefaultQuirks {
+  static const bool LOAD_STORE_MOVES_I = true;
+  static const bool SPRITES_WRAP = true;
+};
+
+enum QuirkProfile : uint8_t {
+  QUIRKS_DEFAULT,
+  QUIRKS_COSMAC,
+  QUIRKS_SCHIP,
+  QUIRKS_XOCHIP
+};
+
+/**
+ * Guesses the profile a ROM was written for from the instructions it
+ * contains: any XO-CHIP-only instruction (long I, plane select, audio,
+ * register range save/load, scroll up) or a ROM too big for 4K means
+ * XO-CHIP; any SUPER-CHIP-only one (hires, scrolls, exit, big font, flag
+ * registers) means SUPER-CHIP. Anything else runs with the defaults.
+ */
+inline QuirkProfile DetectQuirks(const uint8_t* rom, size_t size) {
+  if (size > MAX_ROM_SIZE) {
+    return QUIRKS_XOCHIP;
+  }
+
+  bool schip = false;
+  for (size_t i = 0; i + 1 < size; i += 2) {
+    uint16_t opcode = (rom[i] << 8u) | rom[i + 1];
+
+    if (opcode == 0xF000u || opcode == 0xF002u || (opcode & 0xF0FFu) == 0xF001u
+      || (opcode & 0xF00Eu) == 0x5002u || (opcode & 0xFFF0u) == 0x00D0u) {
+      return QUIRKS_XOCHIP;
+    }
+
+    if ((opcode & 0xFFF0u) == 0x00C0u || (opcode >= 0x00FBu && opcode <= 0x00FFu)
+      || (opcode & 0xF0FFu) == 0xF030u || (opcode & 0xF0FFu) == 0xF075u
+      || (opcode & 0xF0FFu) == 0xF085u) {
+      schip = true;
+    }
+  }
+
+  return schip ? QUIRKS_SCHIP : QUIRKS_DEFAULT;
+}
+
+//Index of the lowest set bit; value must not be zero
+inline unsigned int LowestBit(uint32_t value) {
+#if defined(__GNUC__)
+  return __builtin_ctz(value);
+#else
+  unsigned int bit = 0;
+  while (!(value & 1u)) {
+    value >>= 1;
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
+//Index of the highest set bit; value must not be zero
+inline unsigned int HighestBit(uint32_t value) {
+#if defined(__GNUC__)
+  return 31 - __builtin_clz(value);
+#else
+  unsigned int bit = 0;
+  while (value >>= 1) {
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
+//Colors of set and unset pixels, as RGBA8888
+struct Palette {
+  uint32_t foreground = 0xFFFFFFFF;
+  uint32_t background = 0x00000000;
+};
+
+//Expands packed display rows into RGBA8888 pixel rows pitch bytes apart
+typedef void (*ExpandFunc)(const uint64_t* rows, unsigned int count, uint8_t* pixels, int pitch, const Palette& palette);
+
+void ExpandScalar(const uint64_t* rows, unsigned int count, uint8_t* pixels, int pitch, const Palette& palette) {
+  uint32_t diff = palette.foreground ^ palette.background;
+
+  for (unsigned int row = 0; row < count; ++row, pixels += pitch) {
+    uint32_t* out = reinterpret_cast<uint32_t*>(pixels);
+    for (unsigned int col = 0; col < VIDEO_WIDTH; ++col) {
+      uint32_t mask = 0u - static_cast<uint32_t>((rows[row] >> (VIDEO_WIDTH - 1 - col)) & 1u);
+      out[col] = palette.background ^ (diff & mask);
+    }
+  }
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+//Four pixels per step: broadcast a nibble and compare each lane against its bit
+void ExpandSSE2(const uint64_t* rows, unsigned int count, uint8_t* pixels, int pitch, const Palette& palette) {
+  const __m128i bits = _mm_setr_epi32(8, 4, 2, 1);
+  const __m128i background = _mm_set1_epi32(static_cast<int>(palette.background));
+  const __m128i diff = _mm_set1_epi32(static_cast<int>(palette.foreground ^ palette.background));
+
+  for (unsigned int row = 0; row < count; ++row, pixels += pitch) {
+    __m128i* out = reinterpret_cast<__m128i*>(pixels);
+    for (unsigned int nibble = 0; nibble < VIDEO_WIDTH / 4; ++nibble) {
+      int value = static_cast<int>((rows[row] >> (VIDEO_WIDTH - 4 - 4 * nibble)) & 0xFu);
+      __m128i set = _mm_and_si128(_mm_set1_epi32(value), bits);
+      __m128i mask = _mm_cmpeq_epi32(set, bits);
+      _mm_storeu_si128(out + nibble, _mm_xor_si128(background, _mm_and_si128(diff, mask)));
+    }
+  }
+}
+
+#if defined(__GNUC__)
+#define CHIP8_EXPAND_AVX2 1
+
+//Eight pixels per step, one sprite-sized byte at a time
+__attribute__((target("avx2")))
+void ExpandAVX2(const uint64_t* rows, unsigned int count, uint8_t* pixels, int pitch, const Palette& palette) {
+  const __m256i bits = _mm256_setr_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+  const __m256i background = _mm256_set1_epi32(static_cast<int>(palette.background));
+  const __m256i diff = _mm256_set1_epi32(static_cast<int>(palette.foreground ^ palette.background));
+
+  for (unsigned int row = 0; row < count; ++row, pixels += pitch) {
+    __m256i* out = reinterpret_cast<__m256i*>(pixels);
+    for (unsigned int byte = 0; byte < VIDEO_WIDTH / 8; ++byte) {
+      int value = static_cast<int>((rows[row] >> (VIDEO_WIDTH - 8 - 8 * byte)) & 0xFFu);
+      __m256i set = _mm256_and_si256(_mm256_set1_epi32(value), bits);
+      __m256i mask = _mm256_cmpeq_epi32(set, bits);
+      _mm256_storeu_si256(out + byte, _mm256_xor_si256(background, _mm256_and_si256(diff, mask)));
+    }
+  }
+}
+#endif
+#elif defined(__ARM_NEON)
+//Four pixels per step, selecting each lane with a bit test
+void ExpandNEON(const uint64_t* rows, unsigned int count, uint8_t* pixels, int pitch, const Palette& palette) {
+  static const uint32_t bitValues[4] = {8, 4, 2, 1};
+  const uint32x4_t bits = vld1q_u32(bitValues);
+  const uint32x4_t foreground = vdupq_n_u32(palette.foreground);
+  const uint32x4_t background = vdupq_n_u32(palette.background);
+
+  for (unsigned int row = 0; row < count; ++row, pixels += pitch) {
+    uint32_t* out = reinterpret_cast<uint32_t*>(pixels);
+    for (unsigned int nibble = 0; nibble < VIDEO_WIDTH / 4; ++nibble) {
+      uint32_t value = static_cast<uint32_t>((rows[row] >> (VIDEO_WIDTH - 4 - 4 * nibble)) & 0xFu);
+      uint32x4_t mask = vtstq_u32(vdupq_n_u32(value), bits);
+      vst1q_u32(out + 4 * nibble, vbslq_u32(mask, foreground, background));
+    }
+  }
+}
+#endif
+
+//Pick the widest expansion kernel the running CPU supports
+ExpandFunc SelectExpandKernel() {
+#if defined(CHIP8_EXPAND_AVX2)
+  if (__builtin_cpu_supports("avx2")) {
+    return ExpandAVX2;
+  }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+  return ExpandSSE2;
+#elif defined(__ARM_NEON)
+  return ExpandNEON;
+#else
+  return ExpandScalar;
+#endif
+}
+
+//Expand packed display rows into RGBA8888 pixels using the best available kernel
+void ExpandDisplay(const uint64_t* rows, unsigned int count, void* pixels, int pitch, const Palette& palette) {
+  static const ExpandFunc kernel = SelectExpandKernel();
+  kernel(rows, count, static_cast<uint8_t*>(pixels), pitch, palette);
+}
+
+#if !defined(CHIP8_HEADLESS)
 class Platform {
   public:
-    Chip8(char const* title, int windowWidth, int windowHeight, int textureWidth, int textureHeight) {
+    Platform(char const* title, int windowWidth, int windowHeight, int textureWidth, int textureHeight) {
       SDL_Init(SDL_INIT_VIDEO);
       window = SDL_CreateWindow(title, 0, 0, windowWidth, windowHeight, SDL_WINDOW_SHOWN);
       renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
       texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, textureWidth, textureHeight);
     }
 
-    ~Chip8() {
+    ~Platform() {
       SDL_DestroyTexture(texture);
       SDL_DestroyRenderer(renderer);
       SDL_DestroyWindow(window);
       SDL_Quit();
     }
 
-    void Update(void const* buffer, int pitch) {
-      SDL_UpdateTexture(texture, nullptr, buffer, pitch);
+    /**
+     * Expand the rows of the packed display marked in dirtyRows straight
+     * into the streaming texture and present it, then clear dirtyRows.
+     * Clean frames are neither uploaded nor presented unless the window
+     * needs repainting. If the texture cannot be locked, dirtyRows is
+     * left as it is and nothing is presented. Returns whether the frame
+     * was presented.
+     */
+    bool Update(const uint64_t* display, uint32_t& dirtyRows) {
+      if (redraw) {
+        dirtyRows = ~0u;
+        redraw = false;
+      }
+
+      if (dirtyRows == 0) {
+        ++framesSkipped;
+        return false;
+      }
+
+      unsigned int first = LowestBit(dirtyRows);
+      unsigned int last = HighestBit(dirtyRows);
+      SDL_Rect rect{0, static_cast<int>(first), VIDEO_WIDTH, static_cast<int>(last - first + 1)};
+      void* pixels;
+      int pitch;
+
+      // Keep the rows dirty so the next frame retries the upload
+      if (SDL_LockTexture(texture, &rect, &pixels, &pitch) != 0) {
+        return false;
+      }
+      ExpandDisplay(display + first, last - first + 1, pixels, pitch, palette);
+      SDL_UnlockTexture(texture);
+      dirtyRows = 0;
+
       SDL_RenderClear(renderer);
       SDL_RenderCopy(renderer, texture, nullptr, nullptr);
       SDL_RenderPresent(renderer);
+      return true;
+    }
+
+    //Number of Update() calls skipped because nothing changed
+    uint64_t FramesSkipped() const {
+      return framesSkipped;
     }
 
-    bool ProcessInput(uint8_t* keys) {
+    //Sleep until the next input event, which ProcessInput() then handles
+    void WaitForInput() {
+      SDL_WaitEvent(nullptr);
+    }
+
+    bool ProcessInput(uint16_t& keys) {
       bool quit = false;
       SDL_Event event;
 
@@ -65,142 +581,154 @@ class Platform {
             quit = true;
             break;
 
+          case SDL_WINDOWEVENT:
+            redraw = true;
+            break;
+
           case SDL_KEYDOWN: {
             switch (event.key.keysym.sym) {
               case SDLK_ESCAPE: 
                 quit = true;
                 break;
 
+              case SDLK_BACKSPACE:
+                rewindHeld = true;
+                break;
+
               case SDLK_x: 
-                keys[0] = 1;
+                keys |= 1u << 0x0;
                 break;
 
               case SDLK_1: 
-                keys[1] = 1;
+                keys |= 1u << 0x1;
                 break;
 
               case SDLK_2: 
-                keys[2] = 1;
+                keys |= 1u << 0x2;
                 break;
 
               case SDLK_3: 
-                keys[3] = 1;
+                keys |= 1u << 0x3;
                 break;
 
               case SDLK_q: 
-                keys[4] = 1;
+                keys |= 1u << 0x4;
                 break;
 
               case SDLK_w: 
-                keys[5] = 1;
+                keys |= 1u << 0x5;
                 break;
 
               case SDLK_e: 
-                keys[6] = 1;
+                keys |= 1u << 0x6;
                 break;
 
               case SDLK_a: 
-                keys[7] = 1;
+                keys |= 1u << 0x7;
                 break;
 
               case SDLK_s: 
-                keys[8] = 1;
+                keys |= 1u << 0x8;
                 break;
 
               case SDLK_d: 
-                keys[9] = 1;
+                keys |= 1u << 0x9;
                 break;
 
               case SDLK_z: 
-                keys[0xA] = 1;
+                keys |= 1u << 0xA;
                 break;
 
               case SDLK_c: 
-                keys[0xB] = 1;
+                keys |= 1u << 0xB;
                 break;
 
               case SDLK_4: 
-                keys[0xC] = 1;
+                keys |= 1u << 0xC;
                 break;
 
               case SDLK_r: 
-                keys[0xD] = 1;
+                keys |= 1u << 0xD;
                 break;
 
               case SDLK_f: 
-                keys[0xE] = 1;
+                keys |= 1u << 0xE;
                 break;
 
               case SDLK_v: 
-                keys[0xF] = 1;
+                keys |= 1u << 0xF;
                 break;
             }
           } break;
 
           case SDL_KEYUP: {
             switch(event.key.keysym.sym) {
+              case SDLK_BACKSPACE:
+                rewindHeld = false;
+                break;
+
               case SDLK_x: 
-                keys[0] = 0;
+                keys &= ~(1u << 0x0);
                 break;
 
               case SDLK_1: 
-                keys[1] = 0;
+                keys &= ~(1u << 0x1);
                 break;
 
               case SDLK_2: 
-                keys[2] = 0;
+                keys &= ~(1u << 0x2);
                 break;
 
               case SDLK_3: 
-                keys[3] = 0;
+                keys &= ~(1u << 0x3);
                 break;
 
               case SDLK_q: 
-                keys[4] = 0;
+                keys &= ~(1u << 0x4);
                 break;
 
               case SDLK_w: 
-                keys[5] = 0;
+                keys &= ~(1u << 0x5);
                 break;
 
               case SDLK_e: 
-                keys[6] = 0;
+                keys &= ~(1u << 0x6);
                 break;
 
               case SDLK_a: 
-                keys[7] = 0;
+                keys &= ~(1u << 0x7);
                 break;
 
               case SDLK_s: 
-                keys[8] = 0;
+                keys &= ~(1u << 0x8);
                 break;
 
               case SDLK_d: 
-                keys[9] = 0;
+                keys &= ~(1u << 0x9);
                 break;
 
               case SDLK_z: 
-                keys[0xA] = 0;
+                keys &= ~(1u << 0xA);
                 break;
 
               case SDLK_c: 
-                keys[0xB] = 0;
+                keys &= ~(1u << 0xB);
                 break;
 
               case SDLK_4: 
-                keys[0xC] = 0;
+                keys &= ~(1u << 0xC);
                 break;
 
               case SDLK_r: 
-                keys[0xD] = 0;
+                keys &= ~(1u << 0xD);
                 break;
 
               case SDLK_f: 
-                keys[0xE] = 0;
+                keys &= ~(1u << 0xE);
                 break;
 
               case SDLK_v: 
-                keys[0xF] = 0;
+                keys &= ~(1u << 0xF);
                 break;
             }
           } break;
@@ -211,259 +739,1026 @@ class Platform {
       return quit;
     }
   
+    void SetPalette(const Palette& colors) {
+      palette = colors;
+      redraw = true;
+    }
+
+    //Whether the rewind key, Backspace, is held down
+    bool RewindHeld() const {
+      return rewindHeld;
+    }
+  
   private:
     
+    Palette palette;
+    bool redraw = true;
+    bool rewindHeld = false;
+    uint64_t framesSkipped = 0;
     SDL_Window* window;
     SDL_Renderer* renderer;
     SDL_Texture* texture;
 
 };
+#endif
 
-class Chip8 {
+/**
+ * Random byte generators for Cxkk. Each engine keeps its whole state in
+ * one uint64_t, so machines stay small, save states stay plain memory and
+ * many lanes can draw at once from an array of states.
+ *
+ * LegacyRng reproduces the std::default_random_engine (minstd_rand0) and
+ * uniform_int_distribution<uint8_t> pair used before, as implemented by
+ * libstdc++, so old seeds give the same numbers. The others are much
+ * cheaper and statistically better, but produce different sequences.
+ */
+enum RngKind : uint8_t {
+  RNG_LEGACY,
+  RNG_XORSHIFT,
+  RNG_PCG,
+  RNG_SPLITMIX
+};
 
-  public:
+struct LegacyRng {
+  static uint64_t Seed(uint64_t seed) {
+    uint64_t state = static_cast<std::minstd_rand0::result_type>(seed) % 2147483647u;
+    return state == 0 ? 1 : state;
+  }
 
-    //Components of CHIP-8
-    uint8_t registers[16];
-    uint8_t memory[4096];
-    uint16_t index;
-    uint16_t pc;
-    uint16_t stack[16];
-    uint8_t sp;
-    uint8_t delayTimer;
-    uint8_t soundTimer;
-    uint8_t keypad[16];
-    uint32_t video[VIDEO_WIDTH * VIDEO_HEIGHT];
-    uint16_t opcode;
-
-    //Helper member variables
-    std::default_random_engine randGen;
-    std::uniform_int_distribution<uint8_t> randByte;
+  //Downscale the engine's [1, 2^31 - 2] to a byte, rejecting the uneven tail
+  static uint8_t Next(uint64_t& state) {
+    uint64_t value;
+    do {
+      state = state * 16807u % 2147483647u;
+      value = state - 1;
+    } while (value >= 2147483392u);
+    return static_cast<uint8_t>(value / 8388607u);
+  }
+};
 
-    //Constructor
-    Chip8() : randGen(std::chrono::system_clock::now().time_since_epoch().count())
-    {
-      // Initialize PC
-      pc = START_ADDRESS;
-
-      // Load fonts into memory
-      for (unsigned int i = 0; i < FONTSET_SIZE; ++i)
-      {
-        memory[FONTSET_START_ADDRESS + i] = fontset[i];
-      }
-
-      // Initialize RNG
-      randByte = std::uniform_int_distribution<uint8_t>(0, 255U);
-
-      //Function Pointer Table
-      void (Chip8::*table[16]) ();
-      void (Chip8::*table0[16]) ();
-      void (Chip8::*table8[16]) ();
-      void (Chip8::*tableE[16]) ();
-      void (Chip8::*tableF[256]) ();
-
-      table[0x0] = &Chip8::Table0;
-      table[0x1] = &Chip8::OP_1nnn;
-      table[0x2] = &Chip8::OP_2nnn;
-      table[0x3] = &Chip8::OP_3xkk;
-      table[0x4] = &Chip8::OP_4xkk;
-      table[0x5] = &Chip8::OP_5xy0;
-      table[0x6] = &Chip8::OP_6xkk;
-      table[0x7] = &Chip8::OP_7xkk;
-      table[0x8] = &Chip8::Table8;
-      table[0x9] = &Chip8::OP_9xy0;
-      table[0xA] = &Chip8::OP_Annn;
-      table[0xB] = &Chip8::OP_Bnnn;
-      table[0xC] = &Chip8::OP_Cxkk;
-      table[0xD] = &Chip8::OP_Dxyn;
-      table[0xE] = &Chip8::TableE;
-      table[0xF] = &Chip8::TableF;
-
-      table0[0x0] = &Chip8::OP_00E0;
-      table0[0xE] = &Chip8::OP_00EE;
-
-      table8[0x0] = &Chip8::OP_8xy0;
-      table8[0x1] = &Chip8::OP_8xy1;
-      table8[0x2] = &Chip8::OP_8xy2;
-      table8[0x3] = &Chip8::OP_8xy3;
-      table8[0x4] = &Chip8::OP_8xy4;
-      table8[0x5] = &Chip8::OP_8xy5;
-      table8[0x6] = &Chip8::OP_8xy6;
-      table8[0x7] = &Chip8::OP_8xy7;
-      table8[0xE] = &Chip8::OP_8xyE;
-
-      tableE[0x1] = &Chip8::OP_ExA1;
-      tableE[0xE] = &Chip8::OP_Ex9E;
-
-      tableF[0x07] = &Chip8::OP_Fx07;
-      tableF[0x0A] = &Chip8::OP_Fx0A;
-      tableF[0x15] = &Chip8::OP_Fx15;
-      tableF[0x18] = &Chip8::OP_Fx18;
-      tableF[0x1E] = &Chip8::OP_Fx1E;
-      tableF[0x29] = &Chip8::OP_Fx29;
-      tableF[0x33] = &Chip8::OP_Fx33;
-      tableF[0x55] = &Chip8::OP_Fx55;
-      tableF[0x65] = &Chip8::OP_Fx65;
-      
-    }
+//Marsaglia xorshift64, top byte
+struct XorshiftRng {
+  static uint64_t Seed(uint64_t seed) {
+    uint64_t state = seed * 0x9E3779B97F4A7C15ull;
+    return state == 0 ? 0x9E3779B97F4A7C15ull : state;
+  }
 
-    void Table0() {
-      ((*this).*(table0[opcode & 0x000Fu]))();
-    }
+  static uint8_t Next(uint64_t& state) {
+    state ^= state << 13u;
+    state ^= state >> 7u;
+    state ^= state << 17u;
+    return static_cast<uint8_t>(state >> 56u);
+  }
+};
 
-    void Table8() {
-      ((*this).*(table8[opcode & 0x000Fu]))();
-    }
+//PCG32 (XSH RR), top byte
+struct PcgRng {
+  static const uint64_t MULTIPLIER = 6364136223846793005ull;
+  static const uint64_t INCREMENT = 1442695040888963407ull;
+
+  static uint64_t Seed(uint64_t seed) {
+    return (seed + INCREMENT) * MULTIPLIER + INCREMENT;
+  }
+
+  static uint8_t Next(uint64_t& state) {
+    uint64_t old = state;
+    state = old * MULTIPLIER + INCREMENT;
+    uint32_t shifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+    uint32_t rotation = static_cast<uint32_t>(old >> 59u);
+    uint32_t value = (shifted >> rotation) | (shifted << ((32u - rotation) & 31u));
+    return static_cast<uint8_t>(value >> 24u);
+  }
+};
+
+//SplitMix64, top byte
+struct SplitMixRng {
+  static uint64_t Seed(uint64_t seed) {
+    return seed;
+  }
+
+  static uint8_t Next(uint64_t& state) {
+    state += 0x9E3779B97F4A7C15ull;
+    uint64_t value = state;
+    value = (value ^ (value >> 30u)) * 0xBF58476D1CE4E5B9ull;
+    value = (value ^ (value >> 27u)) * 0x94D049BB133111EBull;
+    return static_cast<uint8_t>((value ^ (value >> 31u)) >> 56u);
+  }
+};
+
+//Draw a byte into out[i] for every i with mask[i] set; other states are left alone
+template <typename Engine>
+void NextBytes(uint64_t* states, const uint8_t* mask, uint8_t* out, unsigned int count) {
+  for (unsigned int i = 0; i < count; ++i) {
+    uint64_t state = states[i];
+    out[i] = Engine::Next(state);
+    states[i] = mask[i] ? state : states[i];
+  }
+}
+
+void NextBytes(RngKind kind, uint64_t* states, const uint8_t* mask, uint8_t* out, unsigned int count) {
+  switch (kind) {
+    case RNG_LEGACY:
+      NextBytes<LegacyRng>(states, mask, out, count);
+      break;
+    case RNG_XORSHIFT:
+      NextBytes<XorshiftRng>(states, mask, out, count);
+      break;
+    case RNG_PCG:
+      NextBytes<PcgRng>(states, mask, out, count);
+      break;
+    case RNG_SPLITMIX:
+      NextBytes<SplitMixRng>(states, mask, out, count);
+      break;
+  }
+}
+
+uint64_t SeedRng(RngKind kind, uint64_t seed) {
+  switch (kind) {
+    case RNG_XORSHIFT:
+      return XorshiftRng::Seed(seed);
+    case RNG_PCG:
+      return PcgRng::Seed(seed);
+    case RNG_SPLITMIX:
+      return SplitMixRng::Seed(seed);
+    default:
+      return LegacyRng::Seed(seed);
+  }
+}
+
+//One machine's generator: which engine, and its state
+struct Rng {
+  uint64_t state = 1;
+  RngKind kind = RNG_LEGACY;
 
-    void TableE() {
-      ((*this).*(tableE[opcode & 0x000Fu]))();
+  void Seed(uint64_t seed, RngKind engine) {
+    kind = engine;
+    state = SeedRng(engine, seed);
+  }
+
+  uint8_t NextByte() {
+    switch (kind) {
+      case RNG_XORSHIFT:
+        return XorshiftRng::Next(state);
+      case RNG_PCG:
+        return PcgRng::Next(state);
+      case RNG_SPLITMIX:
+        return SplitMixRng::Next(state);
+      default:
+        return LegacyRng::Next(state);
     }
+  }
+};
+
+/**
+ * Everything that makes up a running CHIP-8 machine, kept in one
+ * trivially copyable block so it can be saved and restored with a
+ * single memcpy.
+ */
+struct Chip8State {
+  //Components of CHIP-8
+  uint8_t registers[16]{};
+  uint8_t memory[4096]{};
+  uint16_t index = 0;
+  uint16_t pc = 0;
+  uint16_t stack[16]{};
+  uint8_t sp = 0;
+  uint8_t delayTimer = 0;
+  uint8_t soundTimer = 0;
+  uint16_t keyMask = 0;             //Keys held down, bit k for key k
+  uint64_t display[VIDEO_HEIGHT]{}; //One bit per pixel, column 0 in the MSB
+
+  //Suspended on Fx0A until a key is down, and the Vx it will take the key
+  bool keyWait = false;
+  uint8_t keyWaitRegister = 0;
+
+  //Random number source for Cxkk
+  Rng rng;
+};
+
+static_assert(std::is_trivially_copyable<Chip8State>::value, "Chip8State must be copyable with memcpy");
+
+/**
+ * Versioned save state: a small header followed by the raw Chip8State.
+ * The layout is fixed for a given build, so a Snapshot can be copied or
+ * written to disk as one block.
+ */
+struct Snapshot {
+  static const uint32_t MAGIC = 0x38504843; //"CHP8"
+  static const uint32_t VERSION = 3;
 
-    void TableF() {
-      ((*this).*(tableF[opcode & 0x00FFu]))();
+  uint32_t magic = 0;
+  uint32_t version = 0;
+  Chip8State state;
+};
+
+//64-bit FNV-1a hash
+uint64_t Fnv1a(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+//Predecode cache entries for one 256-byte page of memory
+struct DecodedPage {
+  Instruction entries[256];
+};
+
+/**
+ * Immutable start-up image of a ROM: the state of a machine that has
+ * just loaded it, and every instruction in its memory already decoded.
+ * Machines running the ROM share one image, read its decoded pages until
+ * they write to them, and reset by copying its state back.
+ */
+struct RomImage {
+  uint64_t hash;
+  size_t size;
+  Chip8State state;
+  DecodedPage decoded[16];
+
+  RomImage(const uint8_t* rom, size_t romSize, uint64_t romHash) : hash(romHash), size(romSize) {
+    uint8_t* memory = state.memory;
+    state.pc = START_ADDRESS;
+    memcpy(memory + FONTSET_START_ADDRESS, fontset, FONTSET_SIZE);
+    if (size > 0) {
+      memcpy(memory + START_ADDRESS, rom, size);
     }
 
-    void OP_NULL() {
+    for (unsigned int address = 0; address < sizeof(state.memory); ++address) {
+      decoded[address >> 8u].entries[address & 0xFFu] = PredecodeInstruction(memory, address);
     }
+  }
+};
 
-    void LoadROM(char const* filename) {
-      // Open the file as a stream of binary and move the file pointer to the end
-      std::ifstream file(filename, std::ios::binary | std::ios::ate);
+/**
+ * RomImages by the hash of their ROM bytes. Images live as long as a
+ * machine uses them; Get() builds one again after the last user is gone.
+ * Slots of freed images are swept out whenever the table has doubled
+ * since the last sweep, so running through many ROMs does not grow it.
+ */
+class RomImageCache {
+  public:
+    std::shared_ptr<const RomImage> Get(const uint8_t* rom, size_t size) {
+      uint64_t hash = Fnv1a(rom, size);
+      std::lock_guard<std::mutex> lock(mutex);
 
-      if (file.is_open())
-      {
-        // Get size of file and allocate a buffer to hold the contents
-        std::streampos size = file.tellg();
-        char* buffer = new char[size];
+      std::weak_ptr<const RomImage>& slot = images[hash];
+      std::shared_ptr<const RomImage> image = slot.lock();
+      if (image && image->size == size && (size == 0 || memcmp(image->state.memory + START_ADDRESS, rom, size) == 0)) {
+        return image;
+      }
 
-        // Go back to the beginning of the file and fill the buffer
-        file.seekg(0, std::ios::beg);
-        file.read(buffer, size);
-        file.close();
+      // New ROM, or a hash collision: build it, replacing any older entry.
+      // Not make_shared, whose single block a weak_ptr would keep allocated.
+      image = std::shared_ptr<const RomImage>(new RomImage(rom, size, hash));
+      slot = image;
 
-        // Load the ROM contents into the Chip8's memory, starting at 0x200
-        for (long i = 0; i < size; ++i)
-        {
-          memory[START_ADDRESS + i] = buffer[i];
+      if (images.size() >= sweepAt) {
+        for (auto it = images.begin(); it != images.end();) {
+          it = it->second.expired() ? images.erase(it) : std::next(it);
         }
+        sweepAt = 2 * images.size() + 16;
+      }
+      return image;
+    }
+
+  private:
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::weak_ptr<const RomImage>> images;
+    size_t sweepAt = 16; //Table size at which expired slots are next swept out
+};
+
+RomImageCache romImageCache;
+
+/**
+ * Predecoded instruction for every memory address, in 16 pages of 256.
+ * Each page is read from the shared RomImage until the first write to
+ * it, which gives the machine its own copy of that page (copy on write).
+ * A page allocated for a copy is kept when the cache goes back to the
+ * image, and the next write to the page copies into it again.
+ */
+class PredecodeCache {
+  public:
+    explicit PredecodeCache(std::shared_ptr<const RomImage> base) {
+      Share(std::move(base));
+    }
+
+    PredecodeCache(const PredecodeCache& other) {
+      *this = other;
+    }
 
-        // Free the buffer
-        delete[] buffer;
+    PredecodeCache& operator=(const PredecodeCache& other) {
+      if (this != &other) {
+        image = other.image;
+        privatePages = other.privatePages;
+        ++generation;
+        for (unsigned int page = 0; page < 16; ++page) {
+          bool copied = (privatePages >> page) & 1u;
+          if (copied && !own[page]) {
+            own[page].reset(new DecodedPage(*other.own[page]));
+          } else if (copied) {
+            *own[page] = *other.own[page];
+          }
+          pages[page] = copied ? own[page]->entries : image->decoded[page].entries;
+        }
       }
+      return *this;
     }
 
-    //Main function
-    void Cycle() {
-      //Fetch: opcode is 64 bits long, so retrieve from 2 memory locations
-      opcode = (memory[pc] << 8u) | memory[pc + 1];  
+    const Instruction& operator[](uint16_t address) const {
+      return pages[address >> 8u][address & 0xFFu];
+    }
 
-      //Increment pc
-      pc += 2;
-      
-      //Decode and execute
-      ((*this).*(table[(opcode & 0xF000u) >> 12u]))();
+    //All entries of one page; the pointer stays valid until Generation() changes
+    const Instruction* Page(unsigned int page) const {
+      return pages[page];
+    }
 
-      //Decrement sound and delay timer if set
-      if (delayTimer > 0) {
-        --delayTimer;
+    //Changes whenever a page moves, so callers holding Page() pointers know to fetch them again
+    uint32_t Generation() const {
+      return generation;
+    }
+
+    //Entry at address, first copying its page if it is still shared
+    Instruction& Writable(uint16_t address) {
+      unsigned int page = address >> 8u;
+      if (!((privatePages >> page) & 1u)) {
+        if (own[page]) {
+          *own[page] = image->decoded[page];
+        } else {
+          own[page].reset(new DecodedPage(image->decoded[page]));
+        }
+        privatePages |= 1u << page;
+        pages[page] = own[page]->entries;
+        ++generation;
       }
-      if (soundTimer > 0) {
-        --soundTimer;
+      return own[page]->entries[address & 0xFFu];
+    }
+
+    //Stop using every private page and read image's instead
+    void Share(std::shared_ptr<const RomImage> base) {
+      image = std::move(base);
+      privatePages = 0;
+      ++generation;
+      for (unsigned int page = 0; page < 16; ++page) {
+        pages[page] = image->decoded[page].entries;
       }
+    }
 
+    const RomImage& Image() const {
+      return *image;
     }
-    
-    /**
-     * 00E0: CLS
-     * Clears the display.
-     */
-    void OP_00E0() {
-      memset(video, 0, VIDEO_HEIGHT * VIDEO_WIDTH);
+
+    //Bit per page this machine has its own copy of
+    uint16_t PrivatePages() const {
+      return privatePages;
     }
-    
-    /**
-     * 00EE: RET
-     * Returns from a subroutine.
-     */
-    void OP_00EE() {
-      --sp;
-      pc = stack[sp];
+
+  private:
+    uint32_t generation = 0;
+    uint16_t privatePages = 0;
+    std::shared_ptr<const RomImage> image;
+    const Instruction* pages[16];
+    std::unique_ptr<DecodedPage> own[16]; //Allocated on first write, in use while its privatePages bit is set
+};
+
+class Chip8 : public Chip8State {
+
+  public:
+
+    uint32_t dirtyRows = 0; //Bit per display row changed since it was last presented
+    uint16_t opcode = 0;
+
+    //Instruction being executed; handlers read their operands from here
+    Instruction instr;
+
+    //Start-up image of the loaded ROM, which Reset() returns to
+    std::shared_ptr<const RomImage> romImage;
+
+    //Predecoded instruction starting at each memory address
+    PredecodeCache decoded;
+
+    //Bit per 256-byte page of memory written since a code cache last cleared it
+    uint16_t pagesWritten = 0;
+
+    //Interpreter variant Run() and Cycle() use
+    QuirkProfile quirks = QUIRKS_DEFAULT;
+
+    //Cycles Run() did not execute because they would only have spun in an idle loop
+    uint64_t idleCyclesSkipped = 0;
+
+    //Whether Run() and the recompilers fast-forward through idle loops; benchmarks turn it off
+    bool skipIdle = true;
+
+    //Constructor
+    Chip8() : Chip8(std::chrono::system_clock::now().time_since_epoch().count()) {
     }
 
-    /**
-     * 1nnn: JP addr
-     * Jumps to location nnn.
-     */
-    void OP_1nnn() {
-      uint16_t address = opcode & 0x0FFFu; //bitmask to get location
-      pc = address;
+    //Constructor with a fixed random seed, for runs that must be reproducible
+    explicit Chip8(uint64_t seed, RngKind engine = RNG_LEGACY)
+      : romImage(romImageCache.Get(nullptr, 0)), decoded(romImage)
+    {
+      // The blank image holds the power-on state: PC at 0x200 and the fonts in memory
+      memcpy(static_cast<Chip8State*>(this), &romImage->state, sizeof(Chip8State));
+      Seed(seed, engine);
+
+      // Memory now matches the blank image the predecode cache starts on;
+      // a code cache must still treat every page as new
+      pagesWritten = 0xFFFFu;
+    }
+
+    void OP_NULL() {
     }
 
     /**
-     * 2nnn: CALL addr
-     * Calls subroutine at location nnn.
+     * Load a ROM image at 0x200 and start the machine from its start-up
+     * image, the one Reset() goes back to, whatever ran before; false if
+     * it is too big to fit. The random number generator carries on.
      */
-    void OP_2nnn() {
-      uint16_t address = opcode & 0x0FFFu;
-      pc = address;
-      stack[sp] = pc;
-      ++sp;
-      pc = address;
+    bool LoadROM(const uint8_t* rom, size_t size) {
+      if (size > MAX_ROM_SIZE) {
+        return false;
+      }
+
+      romImage = romImageCache.Get(rom, size);
+      assert(romImage->size == size);
+      Reset();
+      return true;
     }
 
     /**
-     * 3xkk: SE Vx, byte
-     * Skips next instruction if Vx = kk.
+     * Read a ROM file with one read into a buffer on the stack, then load
+     * it. Returns why it could not be loaded: the file is missing, is not
+     * a regular file, is too big to fit or could not be read whole.
+     * Memory is left as it was unless the whole file was read.
      */
-    void OP_3xkk() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t byte = opcode & 0x00FFu;
-      if (registers[Vx] == byte) {
-        pc += 2;
+    RomError LoadROM(char const* filename) {
+      uint8_t rom[MAX_ROM_SIZE];
+#if defined(CHIP8_POSIX)
+      int fd = open(filename, O_RDONLY);
+      if (fd < 0) {
+        return ROM_MISSING;
+      }
+
+      // A FIFO or device has no size to read and would load as empty
+      struct stat info;
+      RomError error = ROM_OK;
+      if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        error = ROM_NOT_REGULAR;
+      } else if (info.st_size > static_cast<off_t>(MAX_ROM_SIZE)) {
+        error = ROM_TOO_BIG;
+      } else if (read(fd, rom, info.st_size) != info.st_size) {
+        error = ROM_SHORT_READ;
+      }
+      close(fd);
+
+      if (error != ROM_OK) {
+        return error;
+      }
+      LoadROM(rom, info.st_size);
+      return ROM_OK;
+#else
+      std::ifstream file(filename, std::ios::binary | std::ios::ate);
+      if (!file.is_open()) {
+        return ROM_MISSING;
+      }
+
+      std::streamoff size = file.tellg();
+      if (size < 0) {
+        return ROM_NOT_REGULAR;
+      }
+      if (size > static_cast<std::streamoff>(MAX_ROM_SIZE)) {
+        return ROM_TOO_BIG;
       }
+      file.seekg(0, std::ios::beg);
+      file.read(reinterpret_cast<char*>(rom), size);
+      if (file.gcount() != size) {
+        return ROM_SHORT_READ;
+      }
+      LoadROM(rom, size);
+      return ROM_OK;
+#endif
     }
 
     /**
-     * 4xkk: SNE Vx, byte
-     * Skips next instruction if Vx != kk.
+     * Drops predecoded instructions overlapping memory[address,
+     * address + length). Must be called after anything writes to memory.
      */
-    void OP_4xkk() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t byte = opcode & 0x00FFu;
-      if (registers[Vx] != byte) {
-        pc += 2;
+    void InvalidateDecoded(unsigned int address, unsigned int length) {
+      // Writes past the end of memory wrap to its start
+      address &= 0xFFFu;
+      if (address + length > sizeof(memory)) {
+        InvalidateDecoded(0, address + length - sizeof(memory));
+        length = sizeof(memory) - address;
+      }
+
+      // Entries starting up to MAX_FUSED_BYTES - 1 bytes earlier also read memory[address]
+      unsigned int first = address >= MAX_FUSED_BYTES - 1 ? address - (MAX_FUSED_BYTES - 1) : 0;
+      unsigned int last = address + length < sizeof(memory) ? address + length : sizeof(memory);
+
+      for (unsigned int addr = first; addr < last; ++addr) {
+        // Before address - 1, only superinstructions reach this far
+        if (addr + 1 < address && decoded[addr].id <= ID_UNDECODED) {
+          continue;
+        }
+        decoded.Writable(addr).id = ID_UNDECODED;
+      }
+
+      for (unsigned int page = address >> 8u; page < (last + 0xFFu) >> 8u; ++page) {
+        pagesWritten |= 1u << page;
+      }
+
+      // The instruction at the last address ends with the first byte
+      if (address == 0 && length > 0 && decoded[0xFFFu].id != ID_UNDECODED) {
+        decoded.Writable(0xFFFu).id = ID_UNDECODED;
       }
     }
 
     /**
-     * 5xy0: SE Vx, Vy
-     * Skips next instruction if Vx = Vy.
+     * Fill the predecode cache entry for the instruction at address. A
+     * superinstruction takes the rest of its run from the entries after
+     * it, so any of those waiting to be decoded get their fields now.
      */
-    void OP_5xy0() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
-      if (registers[Vx] == registers[Vy]) {
-        pc += 2;
+    void Predecode(uint16_t address) {
+      Instruction instr = PredecodeInstruction(memory, address);
+      decoded.Writable(address) = instr;
+
+      if (instr.id > ID_UNDECODED) {
+        unsigned int end = std::min<unsigned int>(address + MAX_FUSED_BYTES, (address | 0xFFu) + 1);
+        for (unsigned int addr = address + 2; addr < end; addr += 2) {
+          if (decoded[addr].id == ID_UNDECODED) {
+            decoded.Writable(addr) = DecodeInstruction((memory[addr] << 8u) | memory[(addr + 1) & 0xFFFu]);
+            decoded.Writable(addr).id = ID_UNDECODED;
+          }
+        }
       }
     }
 
     /**
-     * 6xnn: LD Vx, nn
-     * Loads 8-bit number nn into register Vx.
+     * Returns to the state right after the ROM was loaded: one block copy
+     * of the start-up image, and the predecode cache back on its shared
+     * pages. The random number generator carries on; Seed() it as well to
+     * repeat a run. Quirks and the ROM stay as they are.
      */
-    void OP_6xkk() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t byte = opcode & 0x00FFu;
-      registers[Vx] = byte;
+    void Reset() {
+      Rng keep = rng;
+      memcpy(static_cast<Chip8State*>(this), &romImage->state, sizeof(Chip8State));
+      rng = keep;
+      ShareRomImage();
     }
 
     /**
-     * 7xnn: ADD Vx, nn
+     * Restores snapshot like Load(). A snapshot whose memory is the
+     * loaded ROM's start-up image, as one saved right after loading,
+     * is restored with a block copy and no invalidation. Returns false
+     * if snapshot is not a valid save state.
+     */
+    bool ResetFrom(const Snapshot& snapshot) {
+      if (snapshot.magic != Snapshot::MAGIC || snapshot.version != Snapshot::VERSION) {
+        return false;
+      }
+      if (memcmp(snapshot.state.memory, romImage->state.memory, sizeof(memory)) != 0) {
+        return Load(snapshot);
+      }
+
+      memcpy(static_cast<Chip8State*>(this), &snapshot.state, sizeof(Chip8State));
+      ShareRomImage();
+      return true;
+    }
+
+    //Restart the random number generator from a fixed seed
+    void Seed(uint64_t seed, RngKind engine = RNG_LEGACY) {
+      rng.Seed(seed, engine);
+    }
+
+    //Copy the whole machine state into snapshot
+    void Save(Snapshot& snapshot) const {
+      snapshot.magic = Snapshot::MAGIC;
+      snapshot.version = Snapshot::VERSION;
+      memcpy(&snapshot.state, static_cast<const Chip8State*>(this), sizeof(Chip8State));
+    }
+
+    //Replace the whole machine state; returns false if snapshot is not a valid save state
+    bool Load(const Snapshot& snapshot) {
+      if (snapshot.magic != Snapshot::MAGIC || snapshot.version != Snapshot::VERSION) {
+        return false;
+      }
+
+      // Only drop decoded instructions where the restored memory differs
+      const unsigned int CHUNK = 64;
+      for (unsigned int address = 0; address < sizeof(memory); address += CHUNK) {
+        if (memcmp(memory + address, snapshot.state.memory + address, CHUNK) != 0) {
+          InvalidateDecoded(address, CHUNK);
+        }
+      }
+
+      memcpy(static_cast<Chip8State*>(this), &snapshot.state, sizeof(Chip8State));
+      dirtyRows = ~0u;
+      return true;
+    }
+
+    //Main function
+    void Cycle() {
+      switch (quirks) {
+        case QUIRKS_COSMAC:
+          Cycle<CosmacQuirks>();
+          break;
+        case QUIRKS_SCHIP:
+          Cycle<SchipQuirks>();
+          break;
+        case QUIRKS_XOCHIP:
+          Cycle<XoChipQuirks>();
+          break;
+        default:
+          Cycle<DefaultQuirks>();
+          break;
+      }
+    }
+
+    //One instruction with the handlers of one quirk profile
+    template <typename Q>
+    void Cycle() {
+      if (WaitForKey(1)) {
+        return;
+      }
+
+      //Fetch: opcode is 64 bits long, so retrieve from 2 memory locations
+      opcode = (memory[pc] << 8u) | memory[(pc + 1) & 0xFFFu];  
+
+      //Increment pc
+      pc += 2;
+      
+      //Decode and execute; quirked handlers are called directly so they can be inlined into each profile's Cycle()
+      instr = DecodeInstruction(opcode);
+      switch (instr.id) {
+#define CHIP8_OP_SKIP(name)
+#define CHIP8_QUIRKED_CASE(name) case ID_##name: OP_##name<Q>(); break;
+        CHIP8_OPS_QUIRKED(CHIP8_OP_SKIP, CHIP8_QUIRKED_CASE)
+#undef CHIP8_QUIRKED_CASE
+#undef CHIP8_OP_SKIP
+        default:
+          ((*this).*(handlers<Q>[instr.id]))();
+          break;
+      }
+
+      //Memory wraps: stepping or jumping past its end goes on from the start
+      pc &= 0xFFFu;
+    }
+
+    /**
+     * Runs the given number of cycles with a threaded interpreter. Each
+     * opcode, including those in the 0/8/E/F groups, is reached with one
+     * jump through its predecoded handler id, instead of the decode and
+     * member function pointer call Cycle() makes for it. Instructions
+     * are decoded once into the decoded cache and only decoded again
+     * after a write to memory invalidates them. Falls back to a switch
+     * on compilers without labels-as-values. Runs the loop built for the
+     * machine's quirk profile. Every jump checks for an idle loop with
+     * SkipIdle(), and a machine suspended on Fx0A spends its cycles in
+     * WaitForKey(). Runs listed in CHIP8_FUSED_TRIPLES and
+     * CHIP8_FUSED_PAIRS are executed with a single dispatch, leaving the
+     * run early if an instruction in it skips, jumps or waits.
+     */
+    void Run(uint64_t cycles) {
+      switch (quirks) {
+        case QUIRKS_COSMAC:
+          Run<CosmacQuirks>(cycles);
+          break;
+        case QUIRKS_SCHIP:
+          Run<SchipQuirks>(cycles);
+          break;
+        case QUIRKS_XOCHIP:
+          Run<XoChipQuirks>(cycles);
+          break;
+        default:
+          Run<DefaultQuirks>(cycles);
+          break;
+      }
+    }
+
+    //The interpreter loop for one quirk profile
+    template <typename Q>
+    void Run(uint64_t cycles) {
+      cycles -= WaitForKey(cycles);
+      if (cycles == 0) {
+        return;
+      }
+
+#if defined(__GNUC__)
+      static void* const labels[ID_FUSED_END] = {
+#define CHIP8_OP_LABEL(name) &&L_##name,
+#define CHIP8_TRIPLE_LABEL(a, b, c, callA, callB, callC) &&L_##a##_##b##_##c,
+#define CHIP8_PAIR_LABEL(a, b, callA, callB) &&L_##a##_##b,
+        CHIP8_OPS(CHIP8_OP_LABEL)
+        &&L_UNDECODED,
+        CHIP8_FUSED_TRIPLES(CHIP8_TRIPLE_LABEL)
+        CHIP8_FUSED_PAIRS(CHIP8_PAIR_LABEL)
+#undef CHIP8_PAIR_LABEL
+#undef CHIP8_TRIPLE_LABEL
+#undef CHIP8_OP_LABEL
+      };
+
+      // Where pc is after a superinstruction's current handler unless it branched
+      uint16_t fusedNext = 0;
+
+      // Page of the predecode cache pc is in, fetched again only when pc
+      // leaves it or a write moves it
+      const Instruction* page = nullptr;
+      unsigned int pageNumber = ~0u;
+      uint32_t generation = 0;
+
+#define CHIP8_DISPATCH() \
+      if ((pc >> 8u) != pageNumber || decoded.Generation() != generation) { \
+        pageNumber = pc >> 8u; \
+        page = decoded.Page(pageNumber); \
+        generation = decoded.Generation(); \
+      } \
+      instr = page[pc & 0xFFu]; \
+      pc += 2; \
+      goto *labels[instr.id];
+
+      CHIP8_DISPATCH();
+
+    L_UNDECODED:
+      pc -= 2;
+      Predecode(pc);
+      CHIP8_DISPATCH();
+
+#define CHIP8_NEXT() \
+      pc &= 0xFFFu; \
+      if (--cycles == 0) { \
+        return; \
+      } \
+      CHIP8_DISPATCH();
+#define CHIP8_IDLE_CHECK(id) \
+      if (id == ID_1nnn) { \
+        cycles -= SkipIdle(cycles - 1); \
+      } else if (id == ID_Fx0A) { \
+        cycles -= WaitForKey(cycles - 1); \
+      }
+#define CHIP8_OP_BODY(name) \
+    L_##name: \
+      OP_##name(); \
+      CHIP8_IDLE_CHECK(ID_##name) \
+      CHIP8_NEXT()
+#define CHIP8_QUIRKED_BODY(name) \
+    L_##name: \
+      OP_##name<Q>(); \
+      CHIP8_NEXT()
+
+      CHIP8_OPS_QUIRKED(CHIP8_OP_BODY, CHIP8_QUIRKED_BODY)
+
+      // A superinstruction runs its handlers in turn while the budget
+      // lasts, stopping early after a branch. The rest of the run is on
+      // the same page, with its fields current for as long as the first
+      // entry is, and nothing before the last handler moves the page
+#define CHIP8_FUSED_THEN(call) \
+      if (pc != fusedNext) { \
+        CHIP8_NEXT() \
+      } \
+      --cycles; \
+      instr = page[pc & 0xFFu]; \
+      pc += 2; \
+      fusedNext = pc; \
+      call;
+#define CHIP8_TRIPLE_BODY(a, b, c, callA, callB, callC) \
+    L_##a##_##b##_##c: \
+      if (cycles < 3) { \
+        goto L_##a; \
+      } \
+      fusedNext = pc; \
+      callA; \
+      CHIP8_FUSED_THEN(callB) \
+      CHIP8_FUSED_THEN(callC) \
+      CHIP8_IDLE_CHECK(ID_##c) \
+      CHIP8_NEXT()
+#define CHIP8_PAIR_BODY(a, b, callA, callB) \
+    L_##a##_##b: \
+      if (cycles < 2) { \
+        goto L_##a; \
+      } \
+      fusedNext = pc; \
+      callA; \
+      CHIP8_FUSED_THEN(callB) \
+      CHIP8_IDLE_CHECK(ID_##b) \
+      CHIP8_NEXT()
+
+      CHIP8_FUSED_TRIPLES(CHIP8_TRIPLE_BODY)
+      CHIP8_FUSED_PAIRS(CHIP8_PAIR_BODY)
+#undef CHIP8_PAIR_BODY
+#undef CHIP8_TRIPLE_BODY
+#undef CHIP8_FUSED_THEN
+#undef CHIP8_QUIRKED_BODY
+#undef CHIP8_OP_BODY
+#undef CHIP8_IDLE_CHECK
+#undef CHIP8_NEXT
+#undef CHIP8_DISPATCH
+#else
+      while (cycles) {
+        instr = decoded[pc];
+
+        if (instr.id == ID_UNDECODED) {
+          Predecode(pc);
+          continue;
+        }
+        instr.id = BaseOpId(instr.id);
+
+        pc += 2;
+
+        switch (instr.id) {
+#define CHIP8_OP_CASE(name) case ID_##name: OP_##name(); break;
+#define CHIP8_QUIRKED_CASE(name) case ID_##name: OP_##name<Q>(); break;
+          CHIP8_OPS_QUIRKED(CHIP8_OP_CASE, CHIP8_QUIRKED_CASE)
+#undef CHIP8_QUIRKED_CASE
+#undef CHIP8_OP_CASE
+        }
+        pc &= 0xFFFu;
+
+        if (instr.id == ID_1nnn) {
+          cycles -= SkipIdle(cycles - 1);
+        } else if (instr.id == ID_Fx0A) {
+          cycles -= WaitForKey(cycles - 1);
+        }
+        --cycles;
+      }
+#endif
+    }
+
+    //Parked on Fx0A with no key down: nothing runs until the keypad changes
+    bool WaitingForKey() const {
+      return keyWait && !keyMask;
+    }
+
+    /**
+     * Spends up to cycles cycles of a machine suspended on Fx0A: none if it
+     * is not, one taking the lowest key into Vx if a key is down, and
+     * otherwise all of them, since keys only change between Run() calls.
+     * Returns how many.
+     */
+    uint64_t WaitForKey(uint64_t cycles) {
+      if (!keyWait || cycles == 0) {
+        return 0;
+      }
+      if (keyMask) {
+        registers[keyWaitRegister] = LowestBit(keyMask);
+        keyWait = false;
+        return 1;
+      }
+      idleCyclesSkipped += cycles;
+      return cycles;
+    }
+
+    /**
+     * Fast-forwards through an idle loop at pc: one that, until a timer
+     * ticks or a key changes, only repeats itself. Those change between
+     * Run() calls, so the loop can skip straight to the end of the call,
+     * leaving the machine exactly as running it would have. Detects
+     *   A:   1nnn A                 jump to self
+     *   A:   Fx07                   wait on the delay timer,
+     *   A+2: 3xkk (or 4xkk)         while it is not (is) kk
+     *   A+4: 1nnn A
+     * Skips whole iterations only, at most cycles; returns how many.
+     */
+    uint64_t SkipIdle(uint64_t cycles) {
+      if (!skipIdle || pc >= sizeof(memory) - 5) {
+        return 0;
+      }
+
+      const Instruction& head = decoded[pc];
+      uint8_t headId = BaseOpId(head.id);
+      uint64_t skipped = 0;
+      if (headId == ID_1nnn && head.nnn == pc) {
+        skipped = cycles;
+      } else if (headId == ID_Fx07) {
+        const Instruction& test = decoded[pc + 2];
+        const Instruction& jump = decoded[pc + 4];
+        uint8_t testId = BaseOpId(test.id);
+        bool waiting = testId == ID_3xkk ? delayTimer != test.kk : testId == ID_4xkk && delayTimer == test.kk;
+        if (waiting && test.x == head.x && BaseOpId(jump.id) == ID_1nnn && jump.nnn == pc) {
+          skipped = cycles - cycles % 3;
+          if (skipped > 0) {
+            registers[head.x] = delayTimer;
+          }
+        }
+      }
+
+      idleCyclesSkipped += skipped;
+      return skipped;
+    }
+
+    //Decrement sound and delay timer if set; called at 60 Hz
+    void TickTimers() {
+      if (delayTimer > 0) {
+        --delayTimer;
+      }
+      if (soundTimer > 0) {
+        --soundTimer;
+      }
+    }
+
+    //Apply several 60 Hz timer ticks at once
+    void TickTimers(uint64_t ticks) {
+      delayTimer = delayTimer > ticks ? delayTimer - ticks : 0;
+      soundTimer = soundTimer > ticks ? soundTimer - ticks : 0;
+    }
+    
+    /**
+     * 00E0: CLS
+     * Clears the display.
+     */
+    void OP_00E0() {
+      for (unsigned int row = 0; row < VIDEO_HEIGHT; ++row) {
+        dirtyRows |= static_cast<uint32_t>(display[row] != 0) << row;
+      }
+      memset(display, 0, sizeof(display));
+    }
+    
+    /**
+     * 00EE: RET
+     * Returns from a subroutine. The stack pointer wraps, so a return
+     * with no call pending takes the last of the 16 entries.
+     */
+    void OP_00EE() {
+      sp = (sp - 1) & 0xFu;
+      pc = stack[sp];
+    }
+
+    /**
+     * 1nnn: JP addr
+     * Jumps to location nnn.
+     */
+    void OP_1nnn() {
+      uint16_t address = instr.nnn; //bitmask to get location
+      pc = address;
+    }
+
+    /**
+     * 2nnn: CALL addr
+     * Calls subroutine at location nnn. The stack pointer wraps, so a
+     * 17th nested call overwrites the first return address.
+     */
+    void OP_2nnn() {
+      uint16_t address = instr.nnn;
+      stack[sp & 0xFu] = pc;
+      sp = (sp + 1) & 0xFu;
+      pc = address;
+    }
+
+    /**
+     * 3xkk: SE Vx, byte
+     * Skips next instruction if Vx = kk.
+     */
+    void OP_3xkk() {
+      uint8_t Vx = instr.x;
+      uint8_t byte = instr.kk;
+      if (registers[Vx] == byte) {
+        pc += 2;
+      }
+    }
+
+    /**
+     * 4xkk: SNE Vx, byte
+     * Skips next instruction if Vx != kk.
+     */
+    void OP_4xkk() {
+      uint8_t Vx = instr.x;
+      uint8_t byte = instr.kk;
+      if (registers[Vx] != byte) {
+        pc += 2;
+      }
+    }
+
+    /**
+     * 5xy0: SE Vx, Vy
+     * Skips next instruction if Vx = Vy.
+     */
+    void OP_5xy0() {
+      uint8_t Vx = instr.x;
+      uint8_t Vy = instr.y;
+      if (registers[Vx] == registers[Vy]) {
+        pc += 2;
+      }
+    }
+
+    /**
+     * 6xnn: LD Vx, nn
+     * Loads 8-bit number nn into register Vx.
+     */
+    void OP_6xkk() {
+      uint8_t Vx = instr.x;
+      uint8_t byte = instr.kk;
+      registers[Vx] = byte;
+    }
+
+    /**
+     * 7xnn: ADD Vx, nn
      * Adds number nn to register Vx.
      */
     void OP_7xkk() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t byte = opcode & 0x00FFu;
+      uint8_t Vx = instr.x;
+      uint8_t byte = instr.kk;
       registers[Vx] += byte;
     }
 
@@ -472,8 +1767,8 @@ class Chip8 {
      * Sets register Vx with the value of register Vy.
      */
     void OP_8xy0() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = instr.y;
       registers[Vx] = registers[Vy];
     }
 
@@ -482,10 +1777,14 @@ class Chip8 {
      * Logical OR values in registers Vx and Vy and stores
      * result in Vx.
      */
+    template <typename Q = DefaultQuirks>
     void OP_8xy1() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = instr.y;
       registers[Vx] |= registers[Vy];
+      if (Q::LOGIC_RESETS_VF) {
+        registers[15] = 0;
+      }
     }
 
     /**
@@ -493,10 +1792,14 @@ class Chip8 {
      * Logical AND values in registers Vx and Vy and stores
      * result in Vx.
      */
+    template <typename Q = DefaultQuirks>
     void OP_8xy2() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = instr.y;
       registers[Vx] &= registers[Vy];
+      if (Q::LOGIC_RESETS_VF) {
+        registers[15] = 0;
+      }
     } 
 
     /**
@@ -504,10 +1807,14 @@ class Chip8 {
      * Logical XOR values in registers Vx and Vy and stores
      * result in Vx.
      */
+    template <typename Q = DefaultQuirks>
     void OP_8xy3() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = instr.y;
       registers[Vx] ^= registers[Vy];
+      if (Q::LOGIC_RESETS_VF) {
+        registers[15] = 0;
+      }
     }
 
     /**
@@ -517,8 +1824,8 @@ class Chip8 {
      * set to 1, otherwise 0.
      */
     void OP_8xy4() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = instr.y;
       uint16_t result = registers[Vx] + registers[Vy];
       if (result > 255u){
         registers[15] = 1;
@@ -536,8 +1843,8 @@ class Chip8 {
      * set to 1, otherwise 0.
      */
     void OP_8xy5() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = instr.y;
       if (registers[Vx] > registers[Vy]){
         registers[15] = 1;
       } else {
@@ -550,10 +1857,12 @@ class Chip8 {
      * 8xy6: SHR Vx, Vy
      * Store value of register Vy shifted right by one bit in register
      * Vx. Set register VF to value of LSB of Vy before the shift.
+     * With SHIFT_USES_VY off, Vx is shifted in place instead.
      */
+    template <typename Q = DefaultQuirks>
     void OP_8xy6() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = Q::SHIFT_USES_VY ? instr.y : instr.x;
       registers[15] = (registers[Vy] & 0x1u);
       registers[Vx] = (registers[Vy]>>1);
     } 
@@ -565,8 +1874,8 @@ class Chip8 {
      * set to 1, otherwise 0.
      */
     void OP_8xy7() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = instr.y;
       if (registers[Vy] > registers[Vx]){
         registers[15] = 1;
       } else {
@@ -579,10 +1888,12 @@ class Chip8 {
      * 8xyE: SHL Vx, Vy
      * Store value of register Vy shifted left by one bit in register
      * Vx. Set register VF to value of MSB of Vy before the shift.
+     * With SHIFT_USES_VY off, Vx is shifted in place instead.
      */
+    template <typename Q = DefaultQuirks>
     void OP_8xyE() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = Q::SHIFT_USES_VY ? instr.y : instr.x;
       registers[15] = (registers[Vy] & 0xF0u) >> 7u;
       registers[Vx] = (registers[Vy]<<1);
     } 
@@ -592,8 +1903,8 @@ class Chip8 {
      * Skips next instruction if Vx != Vy.
      */
     void OP_9xy0() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = instr.y;
       if (registers[Vx] != registers[Vy]) {
         pc += 2;
       }
@@ -604,17 +1915,19 @@ class Chip8 {
      * Set index register I as location nnn.
      */
     void OP_Annn() {
-      uint16_t address = opcode & 0x0FFFu;
+      uint16_t address = instr.nnn;
       index = address;
     }
 
     /**
      * Bnnn: JP V0, addr
      * Jumps to location nnn with offset stipulated by value of register V0.
+     * With JUMP_USES_VX, this is Bxnn: the offset comes from Vx instead.
      */
+    template <typename Q = DefaultQuirks>
     void OP_Bnnn() {
-      uint16_t address = opcode & 0x0FFFu;
-      pc = address + registers[0];
+      uint16_t address = instr.nnn;
+      pc = address + registers[Q::JUMP_USES_VX ? instr.x : 0];
     }
 
     /**
@@ -623,9 +1936,9 @@ class Chip8 {
      * number kk.
      */
     void OP_Cxkk() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t byte = (opcode & 0x00FFu);
-      registers[Vx] = (randByte(randGen) & byte);
+      uint8_t Vx = instr.x;
+      uint8_t byte = instr.kk;
+      registers[Vx] = (rng.NextByte() & byte);
     }
     
     /**
@@ -634,36 +1947,41 @@ class Chip8 {
      * starting at the address stored in the index register I. 
      * Sets register VF to 1 if any set pixels are change to unset,
      * 0 otherwise.
+     * Each sprite row is shifted into place and XORed into its display
+     * row in one go; pixels past the right or bottom edge are clipped,
+     * or with SPRITES_WRAP drawn again at the opposite edge.
      */
+    template <typename Q = DefaultQuirks>
     void OP_Dxyn() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t Vy = (opcode & 0x00F0u) >> 4u;
-      uint8_t height = opcode & 0x000Fu;
+      uint8_t Vx = instr.x;
+      uint8_t Vy = instr.y;
+      uint8_t height = instr.n;
 
       uint8_t xPos = registers[Vx] % VIDEO_WIDTH;
       uint8_t yPos = registers[Vy] % VIDEO_HEIGHT;
 
-      registers[15] = 0;
-
-      for (unsigned int row = 0; row < height; row++) {
-        uint8_t spriteByte = memory[index + row];
-
-        for (unsigned int col = 0; col < 8; col++) {
-          uint8_t spritePixel = spriteByte & (0x80u >> col);
-          uint32_t* screenPixel = &video[(yPos + row) * VIDEO_WIDTH];
-
-          if (spritePixel) { //Sprite pixel is set
-            if (*screenPixel == 0xFFFFFFFF) { //Screen pixel also set - collision
-              registers[15] = 1;
-            }
-            
-          } 
+      if (!Q::SPRITES_WRAP && height > VIDEO_HEIGHT - yPos) {
+        height = VIDEO_HEIGHT - yPos;
+      }
 
-          //XOR with sprite pixel since it is now set
-          *screenPixel ^= 0xFFFFFFFF;
+      uint64_t collision = 0;
 
+      for (unsigned int row = 0; row < height; row++) {
+        uint64_t sprite = static_cast<uint64_t>(memory[(index + row) & 0xFFFu]) << 56u;
+        unsigned int y = (yPos + row) % VIDEO_HEIGHT;
+        if (Q::SPRITES_WRAP) {
+          sprite = (sprite >> xPos) | (sprite << ((VIDEO_WIDTH - xPos) % VIDEO_WIDTH));
+        } else {
+          sprite >>= xPos;
         }
+        uint64_t* screenRow = &display[y];
+
+        collision |= *screenRow & sprite;
+        *screenRow ^= sprite;
+        dirtyRows |= static_cast<uint32_t>(sprite != 0) << y;
       }
+
+      registers[15] = collision != 0;
     }
 
      /**
@@ -671,9 +1989,9 @@ class Chip8 {
      * Skip next instruction if key with the value of Vx is pressed.
      */
     void OP_Ex9E() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t key = registers[Vx];
-      if (keypad[key]) {
+      uint8_t Vx = instr.x;
+      uint8_t key = registers[Vx] & 0xFu;
+      if ((keyMask >> key) & 1u) {
         pc += 2;
       }
     }
@@ -683,9 +2001,9 @@ class Chip8 {
      * Skip next instruction if key with the value of Vx is not pressed.
      */
     void OP_ExA1() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-      uint8_t key = registers[Vx];
-      if (!keypad[key]) {
+      uint8_t Vx = instr.x;
+      uint8_t key = registers[Vx] & 0xFu;
+      if (!((keyMask >> key) & 1u)) {
         pc += 2;
       }
     }
@@ -695,51 +2013,22 @@ class Chip8 {
      * Set Vx = delay timer value
      */
     void OP_Fx07() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+      uint8_t Vx = instr.x;
       registers[Vx] = delayTimer;
     }
     
     /**
      * Fx0A: LD Vx, K
-     * Wait for a key press, store the value of the key in Vx.
+     * Wait for a key press, store the value of the key in Vx. With no key
+     * down the machine suspends rather than running Fx0A again, and
+     * WaitForKey() takes the key once one is.
      */
     void OP_Fx0A() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-
-      if (keypad[0]) {
-        registers[Vx] = 0;
-      } else if (keypad[1]) {
-        registers[Vx] = 1;
-      } else if (keypad[2]) {
-        registers[Vx] = 2;
-      } else if (keypad[3]) {
-        registers[Vx] = 3;
-      } else if (keypad[4]) {
-        registers[Vx] = 4;
-      } else if (keypad[5]) {
-        registers[Vx] = 5;
-      } else if (keypad[6]) {
-        registers[Vx] = 6;
-      } else if (keypad[7]) {
-        registers[Vx] = 7;
-      } else if (keypad[8]) {
-        registers[Vx] = 8;
-      } else if (keypad[9]) {
-        registers[Vx] = 9;
-      } else if (keypad[10]) {
-        registers[Vx] = 10;
-      } else if (keypad[11]) {
-        registers[Vx] = 11;
-      } else if (keypad[12]) {
-        registers[Vx] = 12;
-      } else if (keypad[13]) {
-        registers[Vx] = 13;
-      } else if (keypad[14]) {
-        registers[Vx] = 14;
-      } else if (keypad[15]) {
-        registers[Vx] = 15;
+      if (keyMask) {
+        registers[instr.x] = LowestBit(keyMask);
       } else {
-        pc -= 2;
+        keyWait = true;
+        keyWaitRegister = instr.x;
       }
     }
 
@@ -748,7 +2037,7 @@ class Chip8 {
      * Set delay timer = Vx.
      */
     void OP_Fx15() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+      uint8_t Vx = instr.x;
       delayTimer = registers[Vx];
     }
 
@@ -757,7 +2046,7 @@ class Chip8 {
      * Set sound timer = Vx.
      */
     void OP_Fx18() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+      uint8_t Vx = instr.x;
       soundTimer = registers[Vx];
     }  
 
@@ -766,7 +2055,7 @@ class Chip8 {
      * Set I = I + Vx.
      */
     void OP_Fx1E() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+      uint8_t Vx = instr.x;
       index += registers[Vx];
     }
 
@@ -775,9 +2064,9 @@ class Chip8 {
      * Set I = location of sprite for digit Vx
      */
     void OP_Fx29() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+      uint8_t Vx = instr.x;
       uint8_t digit = registers[Vx];
-      index += FONTSET_START_ADDRESS + (5 * digit);
+      index = FONTSET_START_ADDRESS + (5 * digit);
     }
 
     /**
@@ -786,49 +2075,4555 @@ class Chip8 {
      * I, I+1 and I+2.
      * The interpreter takes the decimal value of Vx, and places
      * the hundreds digit at I, tens digit at I+1 and ones digit
-     * at I+2.
+     * at I+2. Like every access through I, these wrap past the end
+     * of memory to its start.
      */
     void OP_Fx33() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+      uint8_t Vx = instr.x;
       uint8_t value = registers[Vx];
       
-      memory[index+2] = value % 10;
+      memory[(index + 2) & 0xFFFu] = value % 10;
       value /= 10;
-      memory[index+1] = value % 10;
+      memory[(index + 1) & 0xFFFu] = value % 10;
       value /= 10;
-      memory[index] = value % 10;
+      memory[index & 0xFFFu] = value % 10;
+
+      InvalidateDecoded(index, 3);
     }
 
     /**
      * Fx55: LD [I], Vx
      * Stores registers V0 through Vx in memory starting at 
-     * location I.
+     * location I. With LOAD_STORE_MOVES_I, I is left past the last one.
      */
+    template <typename Q = DefaultQuirks>
     void OP_Fx55() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+      uint8_t Vx = instr.x;
       for (int reg = 0; reg <= Vx; reg++) {
           uint8_t value = registers[reg];
-          memory[index + reg] = value;
+          memory[(index + reg) & 0xFFFu] = value;
+      }
+
+      InvalidateDecoded(index, Vx + 1);
+      if (Q::LOAD_STORE_MOVES_I) {
+        index += Vx + 1;
       }
     }
 
     /**
      * Fx65: LD Vx, [I]
      * Read registers V0 through Vx from memory starting at 
-     * location I.
+     * location I. With LOAD_STORE_MOVES_I, I is left past the last one.
      */
+    template <typename Q = DefaultQuirks>
     void OP_Fx65() {
-      uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+      uint8_t Vx = instr.x;
       for (int reg = 0; reg <= Vx; reg++) {
-          registers[reg] = memory[index + reg];
+          registers[reg] = memory[(index + reg) & 0xFFFu];
+      }
+      if (Q::LOAD_STORE_MOVES_I) {
+        index += Vx + 1;
       }
     }
 
+    /**
+     * Memory was just set back to romImage's: drop the private decoded
+     * pages. Only pages that had been written can differ from the image,
+     * unless the cache was on another image (the ROM loaded before, or
+     * Load() of a foreign snapshot).
+     */
+    void ShareRomImage() {
+      pagesWritten |= &decoded.Image() == romImage.get() ? decoded.PrivatePages() : 0xFFFFu;
+      decoded.Share(romImage);
+      dirtyRows = ~0u;
+    }
+
     typedef void (Chip8::*Chip8Func)();
-    Chip8Func table[0xF + 1]{&Chip8::OP_NULL};
-    Chip8Func table0[0xE + 1]{&Chip8::OP_NULL};
-    Chip8Func table8[0xE + 1]{&Chip8::OP_NULL};
-    Chip8Func tableE[0xE + 1]{&Chip8::OP_NULL};
-    Chip8Func tableF[0x65 + 1]{&Chip8::OP_NULL};
-    
+
+    //Handler for each handler id under quirk profile Q, shared by every machine
+    template <typename Q>
+    static const Chip8Func handlers[ID_COUNT];
+};
+
+/**
+ * Second level of Cycle()'s dispatch after opIdTable, built at compile
+ * time from CHIP8_OPS, one table per quirk profile.
+ */
+template <typename Q>
+constexpr Chip8::Chip8Func Chip8::handlers[ID_COUNT] = {
+#define CHIP8_OP_HANDLER(name) &Chip8::OP_##name,
+#define CHIP8_QUIRKED_HANDLER(name) &Chip8::OP_##name<Q>,
+  CHIP8_OPS_QUIRKED(CHIP8_OP_HANDLER, CHIP8_QUIRKED_HANDLER)
+#undef CHIP8_QUIRKED_HANDLER
+#undef CHIP8_OP_HANDLER
+};
+
+/**
+ * Read-only image of a ROM file. Where the OS allows, the file is mapped
+ * rather than copied, so one image can be loaded into any number of
+ * machines without touching the heap. The file must not be truncated
+ * while it is mapped: reading a page past its new end raises SIGBUS.
+ */
+class MappedRom {
+  public:
+    MappedRom() = default;
+
+    explicit MappedRom(char const* filename) {
+      Open(filename);
+    }
+
+    ~MappedRom() {
+      Close();
+    }
+
+    MappedRom(const MappedRom&) = delete;
+    MappedRom& operator=(const MappedRom&) = delete;
+
+    //Returns why the file cannot be used as a ROM: missing, not a regular file, too big or not read whole
+    RomError Open(char const* filename) {
+      Close();
+
+#if defined(CHIP8_POSIX)
+      int fd = open(filename, O_RDONLY);
+      if (fd < 0) {
+        return ROM_MISSING;
+      }
+
+      // A FIFO or device has no size to map and would load as empty
+      struct stat info;
+      if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return ROM_NOT_REGULAR;
+      }
+      if (info.st_size > static_cast<off_t>(MAX_ROM_SIZE)) {
+        close(fd);
+        return ROM_TOO_BIG;
+      }
+      if (info.st_size > 0) {
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+          data = static_cast<const uint8_t*>(mapping);
+          size = info.st_size;
+          mapped = true;
+        }
+      }
+      close(fd);
+
+      if (mapped) {
+        return ROM_OK;
+      }
+#endif
+
+      // Empty files and systems without mmap: read a copy instead
+      std::ifstream file(filename, std::ios::binary);
+      if (!file.is_open()) {
+        return ROM_MISSING;
+      }
+      contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+      if (file.bad()) {
+        contents.clear();
+        return ROM_SHORT_READ;
+      }
+      if (contents.size() > MAX_ROM_SIZE) {
+        contents.clear();
+        return ROM_TOO_BIG;
+      }
+      data = contents.data();
+      size = contents.size();
+      opened = true;
+      return ROM_OK;
+    }
+
+    bool IsOpen() const {
+      return mapped || opened;
+    }
+
+    const uint8_t* Data() const {
+      return data;
+    }
+
+    size_t Size() const {
+      return size;
+    }
+
+  private:
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    bool opened = false;
+    std::vector<uint8_t> contents;
+
+    void Close() {
+#if defined(CHIP8_POSIX)
+      if (mapped) {
+        munmap(const_cast<uint8_t*>(data), size);
+      }
+#endif
+      data = nullptr;
+      size = 0;
+      mapped = false;
+      opened = false;
+      contents.clear();
+    }
 };
+
+/**
+ * Builds a machine for a ROM image, with the quirk profile DetectQuirks()
+ * picks for its contents and the ROM loaded. Returns null if the ROM is
+ * too big to fit, with ROM_TOO_BIG in *error if error is not null.
+ */
+std::unique_ptr<Chip8> CreateChip8(const uint8_t* rom, size_t size, uint64_t seed, RomError* error = nullptr) {
+  std::unique_ptr<Chip8> chip8(new Chip8(seed));
+  chip8->quirks = DetectQuirks(rom, size);
+  bool loaded = chip8->LoadROM(rom, size);
+  if (error) {
+    *error = loaded ? ROM_OK : ROM_TOO_BIG;
+  }
+  return loaded ? std::move(chip8) : nullptr;
+}
+
+//As above, from a ROM file; null if it cannot be loaded, with the reason in *error if error is not null
+std::unique_ptr<Chip8> CreateChip8(char const* romFilename, uint64_t seed, RomError* error = nullptr) {
+  MappedRom rom;
+  RomError opened = rom.Open(romFilename);
+  if (opened != ROM_OK) {
+    if (error) {
+      *error = opened;
+    }
+    return nullptr;
+  }
+  return CreateChip8(rom.Data(), rom.Size(), seed, error);
+}
+
+//Instructions the recompilers translate to native code; the rest are interpreted
+constexpr bool IsTranslated(uint8_t id) {
+  switch (id) {
+    case ID_1nnn: case ID_3xkk: case ID_4xkk: case ID_5xy0: case ID_6xkk:
+    case ID_7xkk: case ID_8xy0: case ID_8xy1: case ID_8xy2: case ID_8xy3:
+    case ID_8xy4: case ID_8xy5: case ID_8xy6: case ID_8xy7: case ID_8xyE:
+    case ID_9xy0: case ID_Annn: case ID_Bnnn: case ID_Fx1E:
+      return true;
+    default:
+      return false;
+  }
+}
+
+//Translated instructions after which a block cannot go straight on
+constexpr bool EndsBlock(uint8_t id) {
+  switch (id) {
+    case ID_1nnn: case ID_3xkk: case ID_4xkk: case ID_5xy0: case ID_9xy0: case ID_Bnnn:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * Whether a translated instruction is one of the arithmetic and shift
+ * ops that set VF as a flag, with operands other than VF. Its flag can
+ * then be left out without changing Vx.
+ */
+constexpr bool SetsFlag(const Instruction& in) {
+  return (in.id == ID_8xy4 || in.id == ID_8xy5 || in.id == ID_8xy6 || in.id == ID_8xy7 || in.id == ID_8xyE) &&
+    in.x != 0xF && in.y != 0xF;
+}
+
+//Whether an instruction may read VF as it was before it, with the default quirks;
+//assumed of every instruction that is not translated
+constexpr bool ReadsFlag(const Instruction& in) {
+  return !IsTranslated(in.id) ? true
+    : SetsFlag(in) || in.id == ID_6xkk || in.id == ID_Annn || in.id == ID_1nnn || in.id == ID_Bnnn ? false
+    : in.id == ID_8xy0 ? in.y == 0xF
+    : in.id == ID_3xkk || in.id == ID_4xkk || in.id == ID_7xkk || in.id == ID_Fx1E ? in.x == 0xF
+    : in.x == 0xF || in.y == 0xF;
+}
+
+//Whether an instruction overwrites VF whatever VF was, with the default quirks
+constexpr bool OverwritesFlag(const Instruction& in) {
+  return SetsFlag(in) || (in.id == ID_6xkk && in.x == 0xF) || (in.id == ID_8xy0 && in.x == 0xF && in.y != 0xF);
+}
+
+/**
+ * Liveness of VF over a block of count translated instructions (at most
+ * 64), which run all together or not at all: returns a bit per
+ * instruction that SetsFlag() a flag a later one in the block overwrites
+ * before anything reads it. VF is live wherever the block ends, as the
+ * machine's state is visible between blocks.
+ */
+inline uint64_t DeadFlags(const Instruction* block, unsigned int count) {
+  uint64_t dead = 0;
+  bool live = true;
+  for (unsigned int i = count; i-- > 0;) {
+    if (SetsFlag(block[i]) && !live) {
+      dead |= uint64_t(1) << i;
+    }
+    live = ReadsFlag(block[i]) || (live && !OverwritesFlag(block[i]));
+  }
+  return dead;
+}
+
+#if defined(CHIP8_JIT)
+/**
+ * Dynamic recompiler for x86-64. Straight-line runs of ALU, Annn and Fx1E
+ * instructions are translated into native functions, ending at a jump,
+ * skip or Bnnn, or before any instruction it does not translate. Those
+ * (2nnn, 00EE, Dxyn, Fx0A, memory and timer ops, ...) are run by the
+ * interpreter, so results are identical to Chip8::Run(). Only machines
+ * with the default quirk profile are translated.
+ *
+ * Flags that an instruction later in the same block overwrites unread
+ * are not computed (see DeadFlags()) unless the Jit is made to keep them.
+ *
+ * Blocks with a constant successor are chained by patching their exit into
+ * a direct jump once the successor is compiled. Every block checks and
+ * charges the cycle budget on entry, so chained loops still stop on time.
+ * Idle loops are skipped between blocks, as in Chip8::Run().
+ * Any write to a page holding compiled code flushes the whole cache.
+ * The cache is never writable and executable at once: Compile() makes it
+ * writable to emit a block and patch exits, then executable again.
+ */
+class Jit {
+  public:
+    explicit Jit(Chip8& vm, bool dropDeadFlags = true) : vm(vm), dropDeadFlags(dropDeadFlags) {
+      void* mapping = mmap(nullptr, CODE_CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      code = mapping == MAP_FAILED ? nullptr : static_cast<uint8_t*>(mapping);
+      Flush();
+    }
+
+    ~Jit() {
+      if (code) {
+        munmap(code, CODE_CACHE_SIZE);
+      }
+    }
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    //False if the code cache could not be mapped, or made executable
+    bool Available() const {
+      return code != nullptr;
+    }
+
+    //Run the given number of cycles, compiling blocks as they are reached.
+    //Translated code has the default quirks; other profiles are interpreted.
+    void Run(uint64_t cycles) {
+      if (!code || vm.quirks != QUIRKS_DEFAULT) {
+        vm.Run(cycles);
+        return;
+      }
+
+      while (cycles > 0) {
+        if (vm.pagesWritten & codePages) {
+          Flush();
+        }
+        vm.pagesWritten = 0;
+
+        cycles -= vm.WaitForKey(cycles);
+        cycles -= vm.SkipIdle(cycles);
+        if (cycles == 0) {
+          break;
+        }
+
+        int32_t entry = vm.pc < sizeof(vm.memory) - 1 ? Lookup(vm.pc) : INTERPRET;
+
+        if (entry != INTERPRET && code) {
+          uint64_t budget = cycles;
+          vm.pc = reinterpret_cast<BlockFunc>(code + entry)(vm.registers, &vm.index, &budget);
+
+          if (budget != cycles) {
+            cycles = budget;
+            continue;
+          }
+        }
+
+        // Not translated, or too few cycles left to run the whole block
+        vm.Run(1);
+        --cycles;
+      }
+    }
+
+  private:
+    //Returns the next pc; budget is the number of cycles left to run
+    typedef uint32_t (*BlockFunc)(uint8_t* registers, uint16_t* index, uint64_t* budget);
+
+    static const size_t CODE_CACHE_SIZE = 256 * 1024;
+    static const unsigned int MAX_BLOCK_INSTRUCTIONS = 64;
+    static const unsigned int MAX_INSTRUCTION_BYTES = 32;
+    static constexpr int32_t UNCOMPILED = -1;
+    static const int32_t INTERPRET = -2;
+
+    //An exit that still returns to Run() because its target is not compiled yet
+    struct ExitSite {
+      uint32_t offset;
+      uint16_t target;
+    };
+
+    Chip8& vm;
+    bool dropDeadFlags;
+    uint8_t* code;
+    uint32_t used;
+    int32_t entries[4096];
+    uint16_t codePages;
+    std::vector<ExitSite> exits;
+
+    void Flush() {
+      used = 0;
+      codePages = 0;
+      exits.clear();
+      std::fill(std::begin(entries), std::end(entries), UNCOMPILED);
+    }
+
+    int32_t Lookup(uint16_t address) {
+      if (entries[address] == UNCOMPILED) {
+        entries[address] = Compile(address);
+      }
+      return entries[address];
+    }
+
+    Instruction Fetch(unsigned int address) const {
+      return DecodeInstruction((vm.memory[address] << 8u) | vm.memory[address + 1]);
+    }
+
+    int32_t Compile(uint16_t start) {
+      // Find the run of translatable instructions starting here
+      Instruction block[MAX_BLOCK_INSTRUCTIONS];
+      unsigned int count = 0;
+      unsigned int address = start;
+      while (count < MAX_BLOCK_INSTRUCTIONS && address < sizeof(vm.memory) - 1) {
+        Instruction in = Fetch(address);
+        if (!IsTranslated(in.id)) {
+          break;
+        }
+        block[count++] = in;
+        address += 2;
+        if (EndsBlock(in.id)) {
+          break;
+        }
+      }
+
+      // The instruction that stopped the scan was read too
+      MarkCodePages(start, address + 2);
+      if (count == 0) {
+        return INTERPRET;
+      }
+
+      // A jump to itself is left to Run(), which skips it, rather than chained into a native spin
+      if (block[0].id == ID_1nnn && block[0].nnn == start) {
+        return INTERPRET;
+      }
+
+      if (used + (count + 2) * MAX_INSTRUCTION_BYTES > CODE_CACHE_SIZE) {
+        Flush();
+        MarkCodePages(start, address + 2);
+      }
+
+      if (!Protect(PROT_READ | PROT_WRITE)) {
+        return INTERPRET;
+      }
+
+      int32_t entry = used;
+      cursor = code + used;
+
+      // Charge the budget up front, bailing out if it cannot cover the block
+      Emit({0x48, 0x8B, 0x02});              // mov rax, [rdx]
+      Emit({0x48, 0x3D}); Emit32(count);     // cmp rax, count
+      Emit({0x0F, 0x82});                    // jb bail
+      uint8_t* bail = cursor;
+      Emit32(0);
+      Emit({0x48, 0x2D}); Emit32(count);     // sub rax, count
+      Emit({0x48, 0x89, 0x02});              // mov [rdx], rax
+
+      uint64_t deadFlags = dropDeadFlags ? DeadFlags(block, count) : 0;
+      address = start;
+      bool exited = false;
+      for (unsigned int i = 0; i < count; ++i, address += 2) {
+        exited = EmitInstruction(block[i], address + 2, (deadFlags >> i) & 1u);
+      }
+      if (!exited) {
+        EmitExit(address);
+      }
+
+      int32_t bailTarget = static_cast<int32_t>(cursor - (bail + 4));
+      memcpy(bail, &bailTarget, 4);
+      Emit(0xB8); Emit32(start);             // mov eax, start
+      Emit(0xC3);                            // ret
+
+      used = static_cast<uint32_t>(cursor - code);
+      entries[start] = entry;
+
+      // Chain exits that were waiting for this block
+      for (size_t i = 0; i < exits.size();) {
+        if (exits[i].target == start) {
+          Patch(exits[i].offset, entry);
+          exits[i] = exits.back();
+          exits.pop_back();
+        } else {
+          ++i;
+        }
+      }
+
+      if (!Protect(PROT_READ | PROT_EXEC)) {
+        return INTERPRET;
+      }
+      return entry;
+    }
+
+    //Switch the code cache between writable and executable; if that fails, stop translating
+    bool Protect(int protection) {
+      if (code && mprotect(code, CODE_CACHE_SIZE, protection) != 0) {
+        munmap(code, CODE_CACHE_SIZE);
+        code = nullptr;
+      }
+      return code != nullptr;
+    }
+
+    //Emit one instruction, without the VF it sets if deadFlag; returns true if it left the block
+    bool EmitInstruction(const Instruction& in, uint16_t next, bool deadFlag) {
+      uint8_t x = in.x;
+      uint8_t y = in.y;
+
+      switch (in.id) {
+        case ID_6xkk:
+          Emit({0xC6, 0x47, x, in.kk});      // mov byte [rdi+x], kk
+          return false;
+
+        case ID_7xkk:
+          Emit({0x80, 0x47, x, in.kk});      // add byte [rdi+x], kk
+          return false;
+
+        case ID_8xy0:
+          Emit({0x8A, 0x47, y});             // mov al, [rdi+y]
+          Emit({0x88, 0x47, x});             // mov [rdi+x], al
+          return false;
+
+        case ID_8xy1:
+        case ID_8xy2:
+        case ID_8xy3: {
+          static const uint8_t ops[] = {0x08, 0x20, 0x30};
+          Emit({0x8A, 0x47, y});             // mov al, [rdi+y]
+          Emit({ops[in.id - ID_8xy1], 0x47, x}); // or/and/xor [rdi+x], al
+          return false;
+        }
+
+        case ID_8xy4:
+          if (!deadFlag) {
+            Emit({0x8A, 0x47, x});           // mov al, [rdi+x]
+            Emit({0x02, 0x47, y});           // add al, [rdi+y]
+            Emit({0x0F, 0x92, 0xC1});        // setc cl
+            Emit({0x88, 0x4F, 0x0F});        // mov [rdi+15], cl
+          }
+          Emit({0x8A, 0x47, y});             // mov al, [rdi+y]
+          Emit({0x00, 0x47, x});             // add [rdi+x], al
+          return false;
+
+        case ID_8xy5:
+          if (!deadFlag) {
+            Emit({0x8A, 0x47, x});           // mov al, [rdi+x]
+            Emit({0x3A, 0x47, y});           // cmp al, [rdi+y]
+            Emit({0x0F, 0x97, 0xC1});        // seta cl
+            Emit({0x88, 0x4F, 0x0F});        // mov [rdi+15], cl
+          }
+          Emit({0x8A, 0x47, y});             // mov al, [rdi+y]
+          Emit({0x28, 0x47, x});             // sub [rdi+x], al
+          return false;
+
+        case ID_8xy6:
+          if (!deadFlag) {
+            Emit({0x8A, 0x47, y});           // mov al, [rdi+y]
+            Emit({0x24, 0x01});              // and al, 1
+            Emit({0x88, 0x47, 0x0F});        // mov [rdi+15], al
+          }
+          Emit({0x8A, 0x47, y});             // mov al, [rdi+y]
+          Emit({0xD0, 0xE8});                // shr al, 1
+          Emit({0x88, 0x47, x});             // mov [rdi+x], al
+          return false;
+
+        case ID_8xy7:
+          if (!deadFlag) {
+            Emit({0x8A, 0x47, y});           // mov al, [rdi+y]
+            Emit({0x3A, 0x47, x});           // cmp al, [rdi+x]
+            Emit({0x0F, 0x97, 0xC1});        // seta cl
+            Emit({0x88, 0x4F, 0x0F});        // mov [rdi+15], cl
+          }
+          Emit({0x8A, 0x47, y});             // mov al, [rdi+y]
+          Emit({0x2A, 0x47, x});             // sub al, [rdi+x]
+          Emit({0x88, 0x47, x});             // mov [rdi+x], al
+          return false;
+
+        case ID_8xyE:
+          if (!deadFlag) {
+            Emit({0x8A, 0x47, y});           // mov al, [rdi+y]
+            Emit({0xC0, 0xE8, 0x07});        // shr al, 7
+            Emit({0x88, 0x47, 0x0F});        // mov [rdi+15], al
+          }
+          Emit({0x8A, 0x47, y});             // mov al, [rdi+y]
+          Emit({0x00, 0xC0});                // add al, al
+          Emit({0x88, 0x47, x});             // mov [rdi+x], al
+          return false;
+
+        case ID_Annn:
+          Emit({0x66, 0xC7, 0x06});          // mov word [rsi], nnn
+          Emit16(in.nnn);
+          return false;
+
+        case ID_Fx1E:
+          Emit({0x0F, 0xB6, 0x47, x});       // movzx eax, byte [rdi+x]
+          Emit({0x66, 0x01, 0x06});          // add [rsi], ax
+          return false;
+
+        case ID_1nnn:
+          EmitExit(in.nnn);
+          return true;
+
+        case ID_Bnnn:
+          Emit({0x0F, 0xB6, 0x47, 0x00});    // movzx eax, byte [rdi]
+          Emit(0x05); Emit32(in.nnn);        // add eax, nnn
+          Emit(0x25); Emit32(0xFFF);         // and eax, 0xFFF
+          Emit(0xC3);                        // ret
+          return true;
+
+        case ID_3xkk:
+        case ID_4xkk:
+          Emit({0x80, 0x7F, x, in.kk});      // cmp byte [rdi+x], kk
+          EmitSkip(in.id == ID_3xkk ? 0x84 : 0x85, next);
+          return true;
+
+        default:
+          Emit({0x8A, 0x47, x});             // mov al, [rdi+x]
+          Emit({0x3A, 0x47, y});             // cmp al, [rdi+y]
+          EmitSkip(in.id == ID_5xy0 ? 0x84 : 0x85, next);
+          return true;
+      }
+    }
+
+    //Exit to next + 2 if the condition holds, otherwise to next
+    void EmitSkip(uint8_t jcc, uint16_t next) {
+      Emit({0x0F, jcc}); Emit32(EXIT_SIZE);  // jcc skip
+      EmitExit(next);
+      EmitExit(next + 2);
+    }
+
+    static const uint32_t EXIT_SIZE = 6;
+
+    //Return target to Run(), or jump straight to its block once compiled
+    void EmitExit(uint16_t target) {
+      target &= 0xFFFu; //Past the last word of memory is the first
+      uint32_t offset = static_cast<uint32_t>(cursor - code);
+      Emit(0xB8); Emit32(target);            // mov eax, target
+      Emit(0xC3);                            // ret
+
+      if (target < sizeof(vm.memory) - 1 && entries[target] >= 0) {
+        Patch(offset, entries[target]);
+      } else {
+        exits.push_back(ExitSite{offset, target});
+      }
+    }
+
+    void Patch(uint32_t offset, int32_t entry) {
+      int32_t rel = entry - static_cast<int32_t>(offset + 5);
+      code[offset] = 0xE9;                   // jmp entry
+      memcpy(code + offset + 1, &rel, 4);
+    }
+
+    void MarkCodePages(unsigned int first, unsigned int last) {
+      for (unsigned int page = first >> 8u; page <= ((last - 1) >> 8u) && page < 16; ++page) {
+        codePages |= 1u << page;
+      }
+    }
+
+    uint8_t* cursor;
+
+    void Emit(uint8_t byte) {
+      *cursor++ = byte;
+    }
+
+    void Emit(std::initializer_list<uint8_t> bytes) {
+      for (uint8_t byte : bytes) {
+        *cursor++ = byte;
+      }
+    }
+
+    void Emit16(uint16_t value) {
+      memcpy(cursor, &value, 2);
+      cursor += 2;
+    }
+
+    void Emit32(uint32_t value) {
+      memcpy(cursor, &value, 4);
+      cursor += 4;
+    }
+};
+
+//Out-of-class definition, needed before C++17 since std::fill() in Flush() binds it by reference
+constexpr int32_t Jit::UNCOMPILED;
+#endif
+
+//Layout of the modules --aot writes, stored in them so a stale build is refused
+const uint32_t AOT_MODULE_VERSION = 1;
+
+#if defined(CHIP8_POSIX)
+/**
+ * Runs a ROM recompiled ahead of time: a shared library built from the
+ * C++ source that --aot writes, with native code for each basic block
+ * found by following the ROM's control flow from START_ADDRESS, entered
+ * through one function at the block's address. Blocks translate the
+ * instructions IsTranslated() accepts and go on to each other directly;
+ * everything else, including Bnnn targets and code never reached
+ * statically, is interpreted, so results are identical to Chip8::Run().
+ *
+ * A module only runs on the ROM it was made from, with the default quirk
+ * profile. Pages of memory holding its code that no longer match the ROM
+ * are interpreted until they do again.
+ */
+class Aot {
+  public:
+    explicit Aot(Chip8& vm) : vm(vm) {
+      std::fill(std::begin(blockAt), std::end(blockAt), false);
+    }
+
+    ~Aot() {
+      if (module) {
+        dlclose(module);
+      }
+    }
+
+    Aot(const Aot&) = delete;
+    Aot& operator=(const Aot&) = delete;
+
+    //Load a module; false if it cannot be loaded or is not an --aot module of this version.
+    //As with dlopen(), a name without a slash is looked for on the library path.
+    bool Open(char const* filename) {
+      void* library = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+      if (!library) {
+        return false;
+      }
+
+      auto version = static_cast<const uint32_t*>(dlsym(library, "chip8_aot_version"));
+      auto hash = static_cast<const uint64_t*>(dlsym(library, "chip8_aot_rom_hash"));
+      auto pages = static_cast<const uint16_t*>(dlsym(library, "chip8_aot_code_pages"));
+      auto count = static_cast<const uint32_t*>(dlsym(library, "chip8_aot_block_count"));
+      auto addresses = static_cast<const uint16_t*>(dlsym(library, "chip8_aot_block_addresses"));
+      auto run = reinterpret_cast<RunFunc>(dlsym(library, "chip8_aot_run"));
+      if (!version || *version != AOT_MODULE_VERSION || !hash || !pages || !count || !addresses || !run) {
+        dlclose(library);
+        return false;
+      }
+
+      if (module) {
+        dlclose(module);
+      }
+      module = library;
+      romHash = *hash;
+      codePages = *pages;
+      stale = 0;
+      enter = run;
+      std::fill(std::begin(blockAt), std::end(blockAt), false);
+      for (uint32_t i = 0; i < *count; ++i) {
+        blockAt[addresses[i] & 0xFFFu] = true;
+      }
+      vm.pagesWritten = 0xFFFFu;
+      return true;
+    }
+
+    //Hash of the ROM the module was made from, as Fnv1a() of its bytes
+    uint64_t RomHash() const {
+      return romHash;
+    }
+
+    //Run the given number of cycles, natively where the module has a block
+    void Run(uint64_t cycles) {
+      if (!module || vm.quirks != QUIRKS_DEFAULT || vm.romImage->hash != romHash) {
+        vm.Run(cycles);
+        return;
+      }
+
+      while (cycles > 0) {
+        if (vm.pagesWritten & codePages) {
+          CheckPages(vm.pagesWritten & codePages);
+        }
+        vm.pagesWritten = 0;
+
+        cycles -= vm.WaitForKey(cycles);
+        cycles -= vm.SkipIdle(cycles);
+        if (cycles == 0) {
+          break;
+        }
+
+        if (vm.pc < sizeof(vm.memory) - 1 && !((stale >> (vm.pc >> 8u)) & 1u) && blockAt[vm.pc]) {
+          uint64_t budget = cycles;
+          vm.pc = enter(vm.pc, vm.registers, &vm.index, &budget, stale);
+
+          if (budget != cycles) {
+            cycles = budget;
+            continue;
+          }
+        }
+
+        // No block, or too few cycles left to run the whole block
+        vm.Run(1);
+        --cycles;
+      }
+    }
+
+  private:
+    //Runs blocks from the one at pc and returns the next pc; budget is the number of
+    //cycles left to run, and a block touching any of the stale pages returns its own address
+    typedef uint32_t (*RunFunc)(uint32_t pc, uint8_t* registers, uint16_t* index, uint64_t* budget, uint32_t stale);
+
+    Chip8& vm;
+    void* module = nullptr;
+    RunFunc enter = nullptr;
+    uint64_t romHash = 0;
+    uint16_t codePages = 0;
+    uint16_t stale = 0; //Bit per page of code that differs from the ROM
+    bool blockAt[4096]; //Whether the module has a block starting at each address
+
+    //Mark each of the given pages stale if it differs from the ROM's start-up image
+    void CheckPages(uint16_t pages) {
+      const uint8_t* image = vm.romImage->state.memory;
+      for (; pages; pages &= pages - 1) {
+        unsigned int page = LowestBit(pages);
+        bool changed = memcmp(vm.memory + (page << 8u), image + (page << 8u), 256) != 0;
+        stale = static_cast<uint16_t>((stale & ~(1u << page)) | (static_cast<unsigned int>(changed) << page));
+      }
+    }
+};
+#endif
+
+/**
+ * Recompiles the ROM of image ahead of time into C++ source for an Aot
+ * module. Code is found by recursive descent from START_ADDRESS: jumps,
+ * calls and both ways of each skip are followed, Bnnn and 00EE are not.
+ * Each basic block of instructions IsTranslated() accepts becomes a
+ * label in one function, entered through a switch on the pc; blocks end
+ * at a jump or skip, before an instruction left to the interpreter, or
+ * where another block begins, and go on to a known successor with a
+ * goto, so the module runs in constant stack however it is built. Flags
+ * DeadFlags() finds are left out. Returns the number of blocks written.
+ */
+size_t WriteAotModule(const RomImage& image, char const* romName, std::ostream& out) {
+  const unsigned int MAX_BLOCK_INSTRUCTIONS = 64;
+  const unsigned int END = sizeof(image.state.memory) - 1;
+  const uint8_t* memory = image.state.memory;
+
+  auto fetch = [&](unsigned int address) {
+    return DecodeInstruction((memory[address] << 8u) | memory[address + 1]);
+  };
+  auto hex = [](uint64_t value, int digits) {
+    std::ostringstream text;
+    text << "0x" << std::uppercase << std::hex << std::setfill('0') << std::setw(digits) << value;
+    return text.str();
+  };
+
+  // Follow the control flow, marking where blocks must begin
+  std::vector<bool> reached(END), leader(END);
+  std::vector<unsigned int> work;
+  auto branch = [&](unsigned int target) {
+    target &= 0xFFFu;
+    if (target < END) {
+      leader[target] = true;
+      work.push_back(target);
+    }
+  };
+  branch(START_ADDRESS);
+  while (!work.empty()) {
+    unsigned int address = work.back();
+    work.pop_back();
+
+    while (address < END && !reached[address]) {
+      reached[address] = true;
+      Instruction in = fetch(address);
+      if (in.id == ID_1nnn) {
+        branch(in.nnn);
+        break;
+      }
+      if (in.id == ID_2nnn) {
+        branch(in.nnn);
+        branch(address + 2);
+        break;
+      }
+      if (in.id == ID_00EE || in.id == ID_Bnnn) {
+        break;
+      }
+      if (EndsBlock(in.id) || in.id == ID_Ex9E || in.id == ID_ExA1) {
+        branch(address + 2);
+        branch(address + 4);
+        break;
+      }
+      if (!IsTranslated(in.id)) {
+        branch(address + 2);
+        break;
+      }
+      address += 2;
+    }
+  }
+
+  // Cut the translatable runs starting at each leader into blocks
+  struct Block {
+    unsigned int start;
+    unsigned int count;
+    bool exits; //Ends in a jump or skip, rather than going on to start + 2 * count
+    uint16_t pages; //Bit per page its instructions lie in
+  };
+  std::vector<Block> blocks;
+  std::vector<bool> hasBlock(END);
+  std::vector<uint16_t> blockPages(END);
+  for (unsigned int start = 0; start < END; ++start) {
+    if (!leader[start]) {
+      continue;
+    }
+
+    Block block{start, 0, false, 0};
+    unsigned int address = start;
+    while (address < END && block.count < MAX_BLOCK_INSTRUCTIONS && !(address != start && leader[address])) {
+      uint8_t id = fetch(address).id;
+      if (!IsTranslated(id)) {
+        break;
+      }
+      ++block.count;
+      address += 2;
+      if (EndsBlock(id)) {
+        block.exits = true;
+        break;
+      }
+    }
+    if (block.count == MAX_BLOCK_INSTRUCTIONS && !block.exits && address < END) {
+      leader[address] = true;
+    }
+
+    // A jump to itself is left to the runtime, which skips it as an idle loop
+    Instruction first = fetch(start);
+    if (block.count == 0 || (first.id == ID_1nnn && first.nnn == start)) {
+      continue;
+    }
+    unsigned int last = start + 2 * block.count - 1;
+    block.pages = static_cast<uint16_t>(((2u << (last >> 8u)) - 1u) & ~((1u << (start >> 8u)) - 1u));
+    blocks.push_back(block);
+    hasBlock[start] = true;
+    blockPages[start] = block.pages;
+  }
+
+  auto name = [&](unsigned int address) {
+    std::ostringstream text;
+    text << "block_" << std::hex << std::setfill('0') << std::setw(3) << address;
+    return text.str();
+  };
+  // A block whose pages the block jumping to it has checked already is entered past its own check,
+  // which keeps the check out of loops
+  std::vector<bool> checkedEntry(END);
+  auto exit = [&](unsigned int target, uint16_t checkedPages) {
+    target &= 0xFFFu;
+    if (target >= END || !hasBlock[target]) {
+      return "LEAVE(" + hex(target, 3) + ");";
+    }
+    if (blockPages[target] & ~checkedPages) {
+      return "goto " + name(target) + ";";
+    }
+    checkedEntry[target] = true;
+    return "goto " + name(target) + "_checked;";
+  };
+
+  out << "// " << romName << ", recompiled ahead of time by --aot. Build it with\n"
+    << "//   c++ -O2 -shared -fPIC <this file> -o <module>\n"
+    << "// and run it with --replay or --bench.\n"
+    << "#include <stdint.h>\n\n"
+    << "// Return to the interpreter at pc, storing back I and the cycles left\n"
+    << "#define LEAVE(pc) do { *i = index; *budget = left; return pc; } while (0)\n\n"
+    << "extern \"C\" uint32_t chip8_aot_run(uint32_t pc, uint8_t* v, uint16_t* i, uint64_t* budget, uint32_t stale) {\n"
+    << "  uint16_t index = *i;\n"
+    << "  uint64_t left = *budget;\n"
+    << "  switch (pc) {\n";
+  for (const Block& block : blocks) {
+    out << "    case " << hex(block.start, 3) << ": goto " << name(block.start) << ";\n";
+  }
+  out << "  }\n"
+    << "  LEAVE(pc);\n";
+
+  // Write the body of each block first, to learn which are jumped into past their page check
+  std::vector<std::string> bodies;
+  for (const Block& block : blocks) {
+    std::ostringstream body;
+
+    Instruction code[MAX_BLOCK_INSTRUCTIONS];
+    for (unsigned int n = 0; n < block.count; ++n) {
+      code[n] = fetch(block.start + 2 * n);
+    }
+    uint64_t deadFlags = DeadFlags(code, block.count);
+
+    for (unsigned int n = 0; n < block.count; ++n) {
+      const Instruction& in = code[n];
+      unsigned int address = block.start + 2 * n;
+      auto flag = [&](const std::string& value) {
+        if (!((deadFlags >> n) & 1u)) {
+          body << "  v[15] = " << value << ";\n";
+        }
+      };
+      std::string vx = "v[" + std::to_string(in.x) + "]";
+      std::string vy = "v[" + std::to_string(in.y) + "]";
+      std::string kk = hex(in.kk, 2);
+      switch (in.id) {
+        case ID_6xkk: body << "  " << vx << " = " << kk << ";\n"; break;
+        case ID_7xkk: body << "  " << vx << " += " << kk << ";\n"; break;
+        case ID_8xy0: body << "  " << vx << " = " << vy << ";\n"; break;
+        case ID_8xy1: body << "  " << vx << " |= " << vy << ";\n"; break;
+        case ID_8xy2: body << "  " << vx << " &= " << vy << ";\n"; break;
+        case ID_8xy3: body << "  " << vx << " ^= " << vy << ";\n"; break;
+        case ID_8xy4:
+          flag(vx + " + " + vy + " > 255");
+          body << "  " << vx << " += " << vy << ";\n";
+          break;
+        case ID_8xy5:
+          flag(vx + " > " + vy);
+          body << "  " << vx << " -= " << vy << ";\n";
+          break;
+        case ID_8xy6:
+          flag(vy + " & 1");
+          body << "  " << vx << " = " << vy << " >> 1;\n";
+          break;
+        case ID_8xy7:
+          flag(vy + " > " + vx);
+          body << "  " << vx << " = " << vy << " - " << vx << ";\n";
+          break;
+        case ID_8xyE:
+          flag(vy + " >> 7");
+          body << "  " << vx << " = " << vy << " << 1;\n";
+          break;
+        case ID_Annn: body << "  index = " << hex(in.nnn, 3) << ";\n"; break;
+        case ID_Fx1E: body << "  index += " << vx << ";\n"; break;
+        case ID_1nnn: body << "  " << exit(in.nnn, block.pages) << "\n"; break;
+        case ID_Bnnn: body << "  LEAVE((" << hex(in.nnn, 3) << " + v[0]) & 0xFFF);\n"; break;
+        default: {
+          // The skips: 3xkk, 4xkk, 5xy0 and 9xy0
+          char const* test = in.id == ID_3xkk ? " == " : in.id == ID_4xkk ? " != " : in.id == ID_5xy0 ? " == " : " != ";
+          std::string right = in.id == ID_3xkk || in.id == ID_4xkk ? kk : vy;
+          body << "  if (" << vx << test << right << ") {\n"
+            << "    " << exit(address + 4, block.pages) << "\n"
+            << "  }\n"
+            << "  " << exit(address + 2, block.pages) << "\n";
+          break;
+        }
+      }
+    }
+    if (!block.exits) {
+      body << "  " << exit(block.start + 2 * block.count, block.pages) << "\n";
+    }
+    bodies.push_back(body.str());
+  }
+
+  uint16_t codePages = 0;
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    const Block& block = blocks[b];
+    codePages |= block.pages;
+    out << "\n" << name(block.start) << ":\n"
+      << "  if (stale & " << hex(block.pages, 4) << "u) {\n"
+      << "    LEAVE(" << hex(block.start, 3) << ");\n"
+      << "  }\n";
+    if (checkedEntry[block.start]) {
+      out << name(block.start) << "_checked:\n";
+    }
+    out << "  if (left < " << block.count << ") {\n"
+      << "    LEAVE(" << hex(block.start, 3) << ");\n"
+      << "  }\n"
+      << "  left -= " << block.count << ";\n"
+      << bodies[b];
+  }
+  out << "}\n";
+
+  // Tables the runtime looks up; the list ends in an unused entry, so that it is never empty
+  out << "\nextern \"C\" const uint32_t chip8_aot_version = " << AOT_MODULE_VERSION << ";\n"
+    << "extern \"C\" const uint64_t chip8_aot_rom_hash = " << hex(image.hash, 16) << "ull;\n"
+    << "extern \"C\" const uint16_t chip8_aot_code_pages = " << hex(codePages, 4) << "u;\n"
+    << "extern \"C\" const uint32_t chip8_aot_block_count = " << blocks.size() << ";\n"
+    << "extern \"C\" const uint16_t chip8_aot_block_addresses[] = {";
+  for (const Block& block : blocks) {
+    out << "\n  " << hex(block.start, 3) << ",";
+  }
+  out << "\n  0\n};\n";
+
+  return blocks.size();
+}
+
+/**
+ * Record of a session's input: every keypad press and release, with the
+ * cycle it took effect at, plus what is needed to start the run again
+ * (random seed, ROM hash, quirk profile, instruction rate) and the hash
+ * of the state it ended in. On disk each event is a varint cycle delta
+ * and one byte, so an hour of play fits in a few kilobytes.
+ */
+class InputLog {
+  public:
+    static const uint32_t MAGIC = 0x4C493843; //"C8IL"
+    static const uint32_t VERSION = 3;
+
+    struct Event {
+      uint64_t cycle;
+      uint8_t key;
+      uint8_t down;
+    };
+
+    uint64_t seed = 0;
+    uint64_t romHash = 0;
+    uint8_t quirks = QUIRKS_DEFAULT;
+    uint32_t instructionsPerFrame = 0;
+    uint64_t frames = 0;
+    uint64_t finalHash = 0;
+    std::vector<Event> events;
+
+    //Log every key whose state differs from the last one logged
+    void RecordKeys(uint64_t cycle, uint16_t keyMask) {
+      for (uint16_t changed = keyMask ^ keys; changed; changed &= changed - 1) {
+        uint8_t key = LowestBit(changed);
+        events.push_back(Event{cycle, key, static_cast<uint8_t>((keyMask >> key) & 1u)});
+      }
+      keys = keyMask;
+    }
+
+    bool Save(char const* filename) const {
+      std::ofstream file(filename, std::ios::binary);
+      if (!file.is_open()) {
+        return false;
+      }
+
+      std::string out;
+      Put(out, MAGIC);
+      Put(out, VERSION);
+      Put(out, seed);
+      Put(out, romHash);
+      Put(out, quirks);
+      Put(out, instructionsPerFrame);
+      Put(out, frames);
+      Put(out, finalHash);
+      Put(out, static_cast<uint64_t>(events.size()));
+
+      uint64_t cycle = 0;
+      for (const Event& event : events) {
+        // Cycle delta as a base-128 varint, then key and state in one byte
+        uint64_t delta = event.cycle - cycle;
+        while (delta >= 0x80u) {
+          out.push_back(static_cast<char>(0x80u | (delta & 0x7Fu)));
+          delta >>= 7u;
+        }
+        out.push_back(static_cast<char>(delta));
+        out.push_back(static_cast<char>(event.key | (event.down << 7u)));
+        cycle = event.cycle;
+      }
+
+      file.write(out.data(), out.size());
+      return file.good();
+    }
+
+    //Returns false if the file is missing, truncated or not an input log
+    bool Load(char const* filename) {
+      std::ifstream file(filename, std::ios::binary);
+      if (!file.is_open()) {
+        return false;
+      }
+      std::string in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+      size_t position = 0;
+      uint32_t magic = 0;
+      uint32_t version = 0;
+      uint64_t count = 0;
+      if (!Get(in, position, magic) || !Get(in, position, version)
+        || magic != MAGIC || version != VERSION
+        || !Get(in, position, seed) || !Get(in, position, romHash) || !Get(in, position, quirks)
+        || !Get(in, position, instructionsPerFrame) || !Get(in, position, frames)
+        || !Get(in, position, finalHash) || !Get(in, position, count)) {
+        return false;
+      }
+
+      events.clear();
+      uint64_t cycle = 0;
+      for (uint64_t i = 0; i < count; ++i) {
+        uint64_t delta = 0;
+        unsigned int shift = 0;
+        uint8_t byte = 0x80u;
+        while (byte & 0x80u) {
+          if (position >= in.size() || shift > 63) {
+            return false;
+          }
+          byte = static_cast<uint8_t>(in[position++]);
+          delta |= static_cast<uint64_t>(byte & 0x7Fu) << shift;
+          shift += 7;
+        }
+        if (position >= in.size()) {
+          return false;
+        }
+        byte = static_cast<uint8_t>(in[position++]);
+        cycle += delta;
+        events.push_back(Event{cycle, static_cast<uint8_t>(byte & 0xFu), static_cast<uint8_t>(byte >> 7u)});
+      }
+      return true;
+    }
+
+  private:
+    uint16_t keys = 0; //Keys down as of the last logged event
+
+    template <typename T>
+    static void Put(std::string& out, T value) {
+      out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static bool Get(const std::string& in, size_t& position, T& value) {
+      if (in.size() - position < sizeof(value)) {
+        return false;
+      }
+      memcpy(&value, in.data() + position, sizeof(value));
+      position += sizeof(value);
+      return true;
+    }
+};
+
+/**
+ * Runs a Chip8 in 60 Hz frames: instructionsPerFrame cycles, then one
+ * tick of the delay and sound timers. Timers therefore follow emulated
+ * time whatever the instruction rate. Throttled, each frame waits for its
+ * slot in wall-clock time; unthrottled, frames run back to back and the
+ * machine behaves exactly the same, only faster. A machine parked on
+ * Fx0A is not run at all until a key is down.
+ */
+class Scheduler {
+  public:
+    static constexpr unsigned int FRAMES_PER_SECOND = 60;
+
+    Scheduler(Chip8& vm, unsigned int instructionsPerFrame, bool throttled = true)
+      : vm(vm), instructionsPerFrame(instructionsPerFrame), throttled(throttled),
+        nextFrame(std::chrono::steady_clock::now()) {}
+
+#if defined(CHIP8_JIT)
+    //Run instructions through the given recompiler instead of the interpreter
+    void UseJit(Jit* recompiler) {
+      jit = recompiler;
+    }
+#endif
+#if defined(CHIP8_POSIX)
+    //Run instructions through a module recompiled ahead of time; takes precedence over a Jit
+    void UseAot(Aot* module) {
+      aot = module;
+    }
+#endif
+
+    void SetInstructionsPerFrame(unsigned int count) {
+      instructionsPerFrame = count;
+    }
+
+    void SetThrottled(bool enabled) {
+      throttled = enabled;
+      nextFrame = std::chrono::steady_clock::now();
+    }
+
+    //Log keypad changes into log; the host updates the keypad between frames
+    void Record(InputLog* log) {
+      recording = log;
+    }
+
+    //Drive the keypad from log instead of the host, starting at cycle 0
+    void Replay(const InputLog* log) {
+      replaying = log;
+      replayEvent = 0;
+    }
+
+    void RunFrame() {
+      if (throttled) {
+        WaitForFrame();
+      }
+
+      if (recording) {
+        recording->RecordKeys(cycles, vm.keyMask);
+      }
+
+      // Stop mid-frame wherever a replayed key changes; a machine parked
+      // on Fx0A stays parked until then
+      uint64_t frameEnd = cycles + instructionsPerFrame;
+      while (cycles < frameEnd) {
+        uint64_t stop = frameEnd;
+        if (replaying) {
+          stop = std::min(stop, ApplyInput());
+        }
+        if (vm.WaitingForKey()) {
+          vm.idleCyclesSkipped += stop - cycles;
+        } else {
+          Execute(stop - cycles);
+        }
+        cycles = stop;
+      }
+
+      vm.TickTimers();
+      ++frames;
+    }
+
+    //Frames in which the machine stays parked on Fx0A are run as timer ticks alone
+    void RunFrames(uint64_t count) {
+      while (count > 0) {
+        uint64_t parked = ParkedFrames(count);
+        if (parked > 0) {
+          SkipFrames(parked);
+          count -= parked;
+        } else {
+          RunFrame();
+          --count;
+        }
+      }
+    }
+
+    //The machine is waiting for a key; the host can sleep until one comes in
+    bool WaitingForKey() const {
+      return vm.WaitingForKey();
+    }
+
+    //Let a frame's time pass without running the machine, as while the host rewinds it
+    void HoldFrame() {
+      if (throttled) {
+        WaitForFrame();
+      }
+    }
+
+    //Frames run so far
+    uint64_t Frames() const {
+      return frames;
+    }
+
+    //Instructions run so far
+    uint64_t Cycles() const {
+      return cycles;
+    }
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    Chip8& vm;
+    unsigned int instructionsPerFrame;
+    bool throttled;
+    Clock::time_point nextFrame;
+    uint64_t frames = 0;
+    uint64_t cycles = 0;
+    InputLog* recording = nullptr;
+    const InputLog* replaying = nullptr;
+    size_t replayEvent = 0;
+#if defined(CHIP8_JIT)
+    Jit* jit = nullptr;
+#endif
+#if defined(CHIP8_POSIX)
+    Aot* aot = nullptr;
+#endif
+
+    void Execute(uint64_t count) {
+#if defined(CHIP8_POSIX)
+      if (aot) {
+        aot->Run(count);
+        return;
+      }
+#endif
+#if defined(CHIP8_JIT)
+      if (jit) {
+        jit->Run(count);
+        return;
+      }
+#endif
+      vm.Run(count);
+    }
+
+    /**
+     * How many of the next count frames the machine is certain to spend
+     * parked on Fx0A: all of them, unless a replayed key event comes
+     * first. Throttled frames are always run one by one.
+     */
+    uint64_t ParkedFrames(uint64_t count) const {
+      if (throttled || instructionsPerFrame == 0 || !vm.WaitingForKey()) {
+        return 0;
+      }
+      if (replaying && replayEvent < replaying->events.size()) {
+        uint64_t next = replaying->events[replayEvent].cycle;
+        count = std::min(count, next > cycles ? (next - cycles) / instructionsPerFrame : 0);
+      }
+      return count;
+    }
+
+    //Same result as count calls to RunFrame() while parked
+    void SkipFrames(uint64_t count) {
+      if (recording) {
+        recording->RecordKeys(cycles, vm.keyMask);
+      }
+      uint64_t skipped = count * instructionsPerFrame;
+      cycles += skipped;
+      vm.idleCyclesSkipped += skipped;
+      vm.TickTimers(count);
+      frames += count;
+    }
+
+    //Apply the replayed events due by now; returns the cycle of the next one
+    uint64_t ApplyInput() {
+      const std::vector<InputLog::Event>& events = replaying->events;
+      while (replayEvent < events.size() && events[replayEvent].cycle <= cycles) {
+        const InputLog::Event& event = events[replayEvent];
+        vm.keyMask = (vm.keyMask & ~(1u << event.key)) | (event.down << event.key);
+        ++replayEvent;
+      }
+      return replayEvent < events.size() ? events[replayEvent].cycle : UINT64_MAX;
+    }
+
+    void WaitForFrame() {
+      const Clock::duration period = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1.0 / FRAMES_PER_SECOND));
+      Clock::time_point now = Clock::now();
+
+      // After a long stall, resume from now rather than racing to catch up
+      if (now - nextFrame > period * FRAMES_PER_SECOND) {
+        nextFrame = now;
+      }
+
+      std::this_thread::sleep_until(nextFrame);
+      nextFrame += period;
+    }
+};
+
+//Out-of-class definition, needed before C++17 since the duration product in WaitForFrame() binds it by reference
+constexpr unsigned int Scheduler::FRAMES_PER_SECOND;
+
+/**
+ * Rewind history of the last few seconds of machine state. Every
+ * keyframeInterval-th recorded frame is kept as a full Snapshot; the
+ * frames in between are stored as the XOR of their Snapshot against
+ * that keyframe, run-length encoded over 64-bit words, since memory and
+ * the display barely change from frame to frame. Deltas live in a
+ * fixed-size byte ring, so memory use never grows past what was asked
+ * for; the oldest frames are dropped first.
+ */
+class RewindBuffer {
+  public:
+    RewindBuffer(unsigned int frames = 60 * Scheduler::FRAMES_PER_SECOND, unsigned int keyframeInterval = 60,
+      size_t deltaBytes = 2 * 1024 * 1024)
+      : entries(frames > 0 ? frames : 1),
+        keyframes(entries.size() / (keyframeInterval > 0 ? keyframeInterval : 1) + 2),
+        keyframeUsers(keyframes.size(), 0),
+        keyframeInterval(keyframeInterval > 0 ? keyframeInterval : 1),
+        arena(deltaBytes) {}
+
+    //Number of frames that can currently be rewound to
+    size_t Frames() const {
+      return count;
+    }
+
+    //Bytes held by keyframes and deltas
+    size_t MemoryUsage() const {
+      return keyframes.size() * sizeof(Snapshot) + arena.size() + entries.size() * sizeof(Entry);
+    }
+
+    //Record the machine state at the end of a frame
+    void Record(const Chip8& chip8) {
+      if (count == entries.size()) {
+        DropOldest();
+      }
+
+      chip8.Save(scratch);
+
+      Entry entry;
+      if (sinceKeyframe == 0 || !EncodeDelta(entry)) {
+        StoreKeyframe(entry);
+      }
+
+      sinceKeyframe = (sinceKeyframe + 1) % keyframeInterval;
+      ++keyframeUsers[entry.keyframe];
+      entries[(first + count) % entries.size()] = entry;
+      ++count;
+    }
+
+    //Drop the newest frame and load the one before it; false if there is none
+    bool StepBack(Chip8& chip8) {
+      if (count < 2) {
+        return false;
+      }
+
+      DropNewest();
+      const Entry& entry = entries[(first + count - 1) % entries.size()];
+      scratch = keyframes[entry.keyframe];
+      ApplyDelta(entry);
+
+      // Resume recording with a fresh keyframe
+      sinceKeyframe = 0;
+      return chip8.Load(scratch);
+    }
+
+  private:
+    static const size_t WORDS = (sizeof(Snapshot) + 7) / 8;
+
+    //One recorded frame: a keyframe slot plus optional delta bytes in the arena
+    struct Entry {
+      uint32_t offset = 0;
+      uint32_t length = 0;
+      uint32_t waste = 0; //Bytes skipped at the end of the arena before offset
+      uint32_t keyframe = 0;
+    };
+
+    std::vector<Entry> entries;
+    size_t first = 0;
+    size_t count = 0;
+
+    std::vector<Snapshot> keyframes;
+    std::vector<uint32_t> keyframeUsers;
+    uint32_t nextKeyframe = 0;
+    uint32_t currentKeyframe = 0;
+    unsigned int keyframeInterval;
+    unsigned int sinceKeyframe = 0;
+
+    std::vector<uint8_t> arena;
+    size_t head = 0;
+    size_t used = 0;
+
+    Snapshot scratch;
+
+    static uint64_t Word(const Snapshot& snapshot, size_t word) {
+      uint64_t value = 0;
+      size_t offset = word * 8;
+      memcpy(&value, reinterpret_cast<const uint8_t*>(&snapshot) + offset, std::min<size_t>(8, sizeof(Snapshot) - offset));
+      return value;
+    }
+
+    static void XorWord(Snapshot& snapshot, size_t word, uint64_t value) {
+      size_t offset = word * 8;
+      size_t size = std::min<size_t>(8, sizeof(Snapshot) - offset);
+      uint8_t* bytes = reinterpret_cast<uint8_t*>(&snapshot) + offset;
+      uint64_t current = 0;
+      memcpy(&current, bytes, size);
+      current ^= value;
+      memcpy(bytes, &current, size);
+    }
+
+    void StoreKeyframe(Entry& entry) {
+      uint32_t slot = nextKeyframe;
+      nextKeyframe = (nextKeyframe + 1) % keyframes.size();
+
+      // Never overwrite a keyframe that recorded frames still depend on
+      while (keyframeUsers[slot] > 0) {
+        DropOldest();
+      }
+
+      keyframes[slot] = scratch;
+      currentKeyframe = slot;
+      sinceKeyframe = 0;
+      entry = Entry();
+      entry.keyframe = slot;
+    }
+
+    /**
+     * Delta format: repeated [uint16 words to skip][uint16 words changed]
+     * followed by the changed words XORed with the keyframe. Returns false
+     * if the delta would not fit comfortably in the arena.
+     */
+    bool EncodeDelta(Entry& entry) {
+      uint8_t buffer[WORDS * 8 + WORDS * 4];
+      size_t length = 0;
+      const Snapshot& keyframe = keyframes[currentKeyframe];
+
+      size_t word = 0;
+      size_t runEnd = 0;
+      while (word < WORDS) {
+        size_t start = word;
+        while (start < WORDS && Word(scratch, start) == Word(keyframe, start)) {
+          ++start;
+        }
+        if (start == WORDS) {
+          break;
+        }
+        size_t end = start;
+        while (end < WORDS && Word(scratch, end) != Word(keyframe, end)) {
+          ++end;
+        }
+
+        uint16_t header[2] = {static_cast<uint16_t>(start - runEnd), static_cast<uint16_t>(end - start)};
+        memcpy(buffer + length, header, sizeof(header));
+        length += sizeof(header);
+        for (size_t w = start; w < end; ++w) {
+          uint64_t delta = Word(scratch, w) ^ Word(keyframe, w);
+          memcpy(buffer + length, &delta, 8);
+          length += 8;
+        }
+
+        runEnd = end;
+        word = end;
+      }
+
+      if (length > arena.size() / 4) {
+        return false;
+      }
+
+      entry.keyframe = currentKeyframe;
+      entry.length = static_cast<uint32_t>(length);
+      Reserve(entry);
+      memcpy(arena.data() + entry.offset, buffer, length);
+      return true;
+    }
+
+    void ApplyDelta(const Entry& entry) {
+      const uint8_t* data = arena.data() + entry.offset;
+      const uint8_t* end = data + entry.length;
+      size_t word = 0;
+
+      while (data < end) {
+        uint16_t header[2];
+        memcpy(header, data, sizeof(header));
+        data += sizeof(header);
+        word += header[0];
+        for (uint16_t i = 0; i < header[1]; ++i, ++word, data += 8) {
+          uint64_t delta;
+          memcpy(&delta, data, 8);
+          XorWord(scratch, word, delta);
+        }
+      }
+    }
+
+    //Find room for entry.length bytes at the head of the arena, dropping old frames as needed
+    void Reserve(Entry& entry) {
+      for (;;) {
+        // Wrap when the entry does not fit before the end, even if head is right at it and nothing is wasted
+        bool wrap = head + entry.length > arena.size();
+        size_t waste = wrap ? arena.size() - head : 0;
+        if (used + waste + entry.length <= arena.size()) {
+          if (wrap) {
+            head = 0;
+          }
+          entry.offset = static_cast<uint32_t>(head);
+          entry.waste = static_cast<uint32_t>(waste);
+          head += entry.length;
+          used += waste + entry.length;
+          return;
+        }
+        DropOldest();
+      }
+    }
+
+    void DropOldest() {
+      if (count == 0) {
+        head = 0;
+        used = 0;
+        return;
+      }
+      const Entry& entry = entries[first];
+      used -= entry.waste + entry.length;
+      --keyframeUsers[entry.keyframe];
+      first = (first + 1) % entries.size();
+      --count;
+      if (count == 0) {
+        head = 0;
+        used = 0;
+      }
+    }
+
+    void DropNewest() {
+      const Entry& entry = entries[(first + count - 1) % entries.size()];
+      used -= entry.waste + entry.length;
+      if (entry.length > 0) {
+        head = entry.waste ? arena.size() - entry.waste : entry.offset;
+      }
+      --keyframeUsers[entry.keyframe];
+      --count;
+    }
+};
+
+//Fields of a Chip8Lanes that its vector kernels step, each an array with one entry per lane
+struct LaneFields {
+  uint8_t* registers; //V0 of every lane, then V1 and so on up to VF
+  uint16_t* pc;
+  uint16_t* index;
+  uint8_t* delayTimer;
+  uint8_t* soundTimer;
+  unsigned int lanes;
+};
+
+//Runs one instruction LaneVectorized() holds on the lanes where the byte mask is set
+typedef void (*LaneKernel)(const Instruction& in, const uint8_t* mask, const LaneFields& lanes);
+
+//Instructions the lane kernels run as masked selects over whole vectors of lanes
+constexpr bool LaneVectorized(uint8_t id) {
+  switch (id) {
+    case ID_1nnn: case ID_3xkk: case ID_4xkk: case ID_5xy0: case ID_9xy0:
+    case ID_6xkk: case ID_7xkk: case ID_8xy0: case ID_8xy1: case ID_8xy2:
+    case ID_8xy3: case ID_8xy4: case ID_8xy5: case ID_8xy6: case ID_8xy7:
+    case ID_8xyE: case ID_Annn: case ID_Fx07: case ID_Fx15: case ID_Fx18:
+    case ID_Fx1E:
+      return true;
+    default:
+      return false;
+  }
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+//Sixteen lanes to a vector
+struct LanesSSE2 {
+  static const unsigned int WIDTH = 16;
+
+  //Lanes where mask is set take value, the rest keep old
+  static __m128i Select(__m128i mask, __m128i value, __m128i old) {
+    return _mm_or_si128(_mm_and_si128(mask, value), _mm_andnot_si128(mask, old));
+  }
+
+  static __m128i Load(const void* from) {
+    return _mm_loadu_si128(static_cast<const __m128i*>(from));
+  }
+
+  static void Store(void* to, __m128i value) {
+    _mm_storeu_si128(static_cast<__m128i*>(to), value);
+  }
+
+  //Add the bytes, widened, to as many words from to on
+  static void AddWide(uint16_t* to, __m128i bytes) {
+    const __m128i zero = _mm_setzero_si128();
+    Store(to, _mm_add_epi16(Load(to), _mm_unpacklo_epi8(bytes, zero)));
+    Store(to + 8, _mm_add_epi16(Load(to + 8), _mm_unpackhi_epi8(bytes, zero)));
+  }
+
+  //Set the words from to on to value where the byte mask is set
+  static void SelectWide(uint16_t* to, __m128i mask, uint16_t value) {
+    __m128i wide = _mm_set1_epi16(static_cast<short>(value));
+    Store(to, Select(_mm_unpacklo_epi8(mask, mask), wide, Load(to)));
+    Store(to + 8, Select(_mm_unpackhi_epi8(mask, mask), wide, Load(to + 8)));
+  }
+
+  static void Step(const Instruction& in, const uint8_t* mask, const LaneFields& lanes) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi8(2);
+    const __m128i kk = _mm_set1_epi8(static_cast<char>(in.kk));
+    const __m128i wrap = _mm_set1_epi16(0x0FFF);
+    uint8_t* Vx = lanes.registers + in.x * lanes.lanes;
+    uint8_t* Vy = lanes.registers + in.y * lanes.lanes;
+    uint8_t* VF = lanes.registers + 15 * lanes.lanes;
+
+    for (unsigned int base = 0; base < lanes.lanes; base += WIDTH) {
+      uint16_t* pc = lanes.pc + base;
+      __m128i m = Load(mask + base);
+      __m128i vx = Load(Vx + base);
+      __m128i vy = Load(Vy + base);
+      __m128i flag = zero;
+      AddWide(pc, _mm_and_si128(m, two));
+
+      switch (in.id) {
+        case ID_1nnn:
+          SelectWide(pc, m, in.nnn);
+          break;
+
+        case ID_3xkk:
+          AddWide(pc, _mm_and_si128(_mm_and_si128(m, _mm_cmpeq_epi8(vx, kk)), two));
+          break;
+
+        case ID_4xkk:
+          AddWide(pc, _mm_and_si128(_mm_andnot_si128(_mm_cmpeq_epi8(vx, kk), m), two));
+          break;
+
+        case ID_5xy0:
+          AddWide(pc, _mm_and_si128(_mm_and_si128(m, _mm_cmpeq_epi8(vx, vy)), two));
+          break;
+
+        case ID_9xy0:
+          AddWide(pc, _mm_and_si128(_mm_andnot_si128(_mm_cmpeq_epi8(vx, vy), m), two));
+          break;
+
+        case ID_6xkk:
+          Store(Vx + base, Select(m, kk, vx));
+          break;
+
+        case ID_7xkk:
+          Store(Vx + base, Select(m, _mm_add_epi8(vx, kk), vx));
+          break;
+
+        case ID_8xy0:
+          Store(Vx + base, Select(m, vy, vx));
+          break;
+
+        case ID_8xy1:
+          Store(Vx + base, Select(m, _mm_or_si128(vx, vy), vx));
+          break;
+
+        case ID_8xy2:
+          Store(Vx + base, Select(m, _mm_and_si128(vx, vy), vx));
+          break;
+
+        case ID_8xy3:
+          Store(Vx + base, Select(m, _mm_xor_si128(vx, vy), vx));
+          break;
+
+        // The flag is stored before the result is worked out from Vx and
+        // Vy loaded again, as in the Chip8 handlers, so x or y being 15
+        // behaves the same. Wrapping and saturating sums differ exactly
+        // when the sum carries; SSE2 has no byte shifts, so those shift
+        // words and drop the bit from the neighbouring byte.
+        case ID_8xy4:
+          flag = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_add_epi8(vx, vy), _mm_adds_epu8(vx, vy)), one);
+          Store(VF + base, Select(m, flag, Load(VF + base)));
+          vx = Load(Vx + base);
+          Store(Vx + base, Select(m, _mm_add_epi8(vx, Load(Vy + base)), vx));
+          break;
+
+        case ID_8xy5:
+          flag = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_subs_epu8(vx, vy), zero), one);
+          Store(VF + base, Select(m, flag, Load(VF + base)));
+          vx = Load(Vx + base);
+          Store(Vx + base, Select(m, _mm_sub_epi8(vx, Load(Vy + base)), vx));
+          break;
+
+        case ID_8xy6:
+          Store(VF + base, Select(m, _mm_and_si128(vy, one), Load(VF + base)));
+          vx = Load(Vx + base);
+          vy = Load(Vy + base);
+          Store(Vx + base, Select(m, _mm_and_si128(_mm_srli_epi16(vy, 1), _mm_set1_epi8(0x7F)), vx));
+          break;
+
+        case ID_8xy7:
+          flag = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_subs_epu8(vy, vx), zero), one);
+          Store(VF + base, Select(m, flag, Load(VF + base)));
+          vx = Load(Vx + base);
+          Store(Vx + base, Select(m, _mm_sub_epi8(Load(Vy + base), vx), vx));
+          break;
+
+        case ID_8xyE:
+          Store(VF + base, Select(m, _mm_and_si128(_mm_srli_epi16(vy, 7), one), Load(VF + base)));
+          vx = Load(Vx + base);
+          vy = Load(Vy + base);
+          Store(Vx + base, Select(m, _mm_add_epi8(vy, vy), vx));
+          break;
+
+        case ID_Annn:
+          SelectWide(lanes.index + base, m, in.nnn);
+          break;
+
+        case ID_Fx07:
+          Store(Vx + base, Select(m, Load(lanes.delayTimer + base), vx));
+          break;
+
+        case ID_Fx15:
+          Store(lanes.delayTimer + base, Select(m, vx, Load(lanes.delayTimer + base)));
+          break;
+
+        case ID_Fx18:
+          Store(lanes.soundTimer + base, Select(m, vx, Load(lanes.soundTimer + base)));
+          break;
+
+        case ID_Fx1E:
+          AddWide(lanes.index + base, _mm_and_si128(m, vx));
+          break;
+
+        default:
+          break;
+      }
+
+      // Memory wraps: stepping or jumping past its end goes on from the start
+      Store(pc, _mm_and_si128(Load(pc), wrap));
+      Store(pc + 8, _mm_and_si128(Load(pc + 8), wrap));
+    }
+  }
+};
+
+#if defined(__GNUC__)
+#define CHIP8_LANES_AVX2 1
+
+//Thirty-two lanes to a vector, as LanesSSE2
+struct LanesAVX2 {
+  static const unsigned int WIDTH = 32;
+
+  __attribute__((target("avx2")))
+  static __m256i Select(__m256i mask, __m256i value, __m256i old) {
+    return _mm256_or_si256(_mm256_and_si256(mask, value), _mm256_andnot_si256(mask, old));
+  }
+
+  __attribute__((target("avx2")))
+  static __m256i Load(const void* from) {
+    return _mm256_loadu_si256(static_cast<const __m256i*>(from));
+  }
+
+  __attribute__((target("avx2")))
+  static void Store(void* to, __m256i value) {
+    _mm256_storeu_si256(static_cast<__m256i*>(to), value);
+  }
+
+  __attribute__((target("avx2")))
+  static void AddWide(uint16_t* to, __m256i bytes) {
+    Store(to, _mm256_add_epi16(Load(to), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes))));
+    Store(to + 16, _mm256_add_epi16(Load(to + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1))));
+  }
+
+  __attribute__((target("avx2")))
+  static void SelectWide(uint16_t* to, __m256i mask, uint16_t value) {
+    __m256i wide = _mm256_set1_epi16(static_cast<short>(value));
+    Store(to, Select(_mm256_cvtepi8_epi16(_mm256_castsi256_si128(mask)), wide, Load(to)));
+    Store(to + 16, Select(_mm256_cvtepi8_epi16(_mm256_extracti128_si256(mask, 1)), wide, Load(to + 16)));
+  }
+
+  __attribute__((target("avx2")))
+  static void Step(const Instruction& in, const uint8_t* mask, const LaneFields& lanes) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi8(2);
+    const __m256i kk = _mm256_set1_epi8(static_cast<char>(in.kk));
+    const __m256i wrap = _mm256_set1_epi16(0x0FFF);
+    uint8_t* Vx = lanes.registers + in.x * lanes.lanes;
+    uint8_t* Vy = lanes.registers + in.y * lanes.lanes;
+    uint8_t* VF = lanes.registers + 15 * lanes.lanes;
+
+    for (unsigned int base = 0; base < lanes.lanes; base += WIDTH) {
+      uint16_t* pc = lanes.pc + base;
+      __m256i m = Load(mask + base);
+      __m256i vx = Load(Vx + base);
+      __m256i vy = Load(Vy + base);
+      __m256i flag = zero;
+      AddWide(pc, _mm256_and_si256(m, two));
+
+      switch (in.id) {
+        case ID_1nnn:
+          SelectWide(pc, m, in.nnn);
+          break;
+
+        case ID_3xkk:
+          AddWide(pc, _mm256_and_si256(_mm256_and_si256(m, _mm256_cmpeq_epi8(vx, kk)), two));
+          break;
+
+        case ID_4xkk:
+          AddWide(pc, _mm256_and_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(vx, kk), m), two));
+          break;
+
+        case ID_5xy0:
+          AddWide(pc, _mm256_and_si256(_mm256_and_si256(m, _mm256_cmpeq_epi8(vx, vy)), two));
+          break;
+
+        case ID_9xy0:
+          AddWide(pc, _mm256_and_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(vx, vy), m), two));
+          break;
+
+        case ID_6xkk:
+          Store(Vx + base, Select(m, kk, vx));
+          break;
+
+        case ID_7xkk:
+          Store(Vx + base, Select(m, _mm256_add_epi8(vx, kk), vx));
+          break;
+
+        case ID_8xy0:
+          Store(Vx + base, Select(m, vy, vx));
+          break;
+
+        case ID_8xy1:
+          Store(Vx + base, Select(m, _mm256_or_si256(vx, vy), vx));
+          break;
+
+        case ID_8xy2:
+          Store(Vx + base, Select(m, _mm256_and_si256(vx, vy), vx));
+          break;
+
+        case ID_8xy3:
+          Store(Vx + base, Select(m, _mm256_xor_si256(vx, vy), vx));
+          break;
+
+        case ID_8xy4:
+          flag = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_add_epi8(vx, vy), _mm256_adds_epu8(vx, vy)), one);
+          Store(VF + base, Select(m, flag, Load(VF + base)));
+          vx = Load(Vx + base);
+          Store(Vx + base, Select(m, _mm256_add_epi8(vx, Load(Vy + base)), vx));
+          break;
+
+        case ID_8xy5:
+          flag = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(vx, vy), zero), one);
+          Store(VF + base, Select(m, flag, Load(VF + base)));
+          vx = Load(Vx + base);
+          Store(Vx + base, Select(m, _mm256_sub_epi8(vx, Load(Vy + base)), vx));
+          break;
+
+        case ID_8xy6:
+          Store(VF + base, Select(m, _mm256_and_si256(vy, one), Load(VF + base)));
+          vx = Load(Vx + base);
+          vy = Load(Vy + base);
+          Store(Vx + base, Select(m, _mm256_and_si256(_mm256_srli_epi16(vy, 1), _mm256_set1_epi8(0x7F)), vx));
+          break;
+
+        case ID_8xy7:
+          flag = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(vy, vx), zero), one);
+          Store(VF + base, Select(m, flag, Load(VF + base)));
+          vx = Load(Vx + base);
+          Store(Vx + base, Select(m, _mm256_sub_epi8(Load(Vy + base), vx), vx));
+          break;
+
+        case ID_8xyE:
+          Store(VF + base, Select(m, _mm256_and_si256(_mm256_srli_epi16(vy, 7), one), Load(VF + base)));
+          vx = Load(Vx + base);
+          vy = Load(Vy + base);
+          Store(Vx + base, Select(m, _mm256_add_epi8(vy, vy), vx));
+          break;
+
+        case ID_Annn:
+          SelectWide(lanes.index + base, m, in.nnn);
+          break;
+
+        case ID_Fx07:
+          Store(Vx + base, Select(m, Load(lanes.delayTimer + base), vx));
+          break;
+
+        case ID_Fx15:
+          Store(lanes.delayTimer + base, Select(m, vx, Load(lanes.delayTimer + base)));
+          break;
+
+        case ID_Fx18:
+          Store(lanes.soundTimer + base, Select(m, vx, Load(lanes.soundTimer + base)));
+          break;
+
+        case ID_Fx1E:
+          AddWide(lanes.index + base, _mm256_and_si256(m, vx));
+          break;
+
+        default:
+          break;
+      }
+
+      Store(pc, _mm256_and_si256(Load(pc), wrap));
+      Store(pc + 16, _mm256_and_si256(Load(pc + 16), wrap));
+    }
+  }
+};
+
+//Sixty-four lanes to a vector, with the lane mask and compare results held in mask registers
+struct LanesAVX512 {
+  static const unsigned int WIDTH = 64;
+
+  __attribute__((target("avx512f,avx512bw")))
+  static __m512i Load(const void* from) {
+    return _mm512_loadu_si512(from);
+  }
+
+  __attribute__((target("avx512f,avx512bw")))
+  static void Store(void* to, __m512i value) {
+    _mm512_storeu_si512(to, value);
+  }
+
+  //Add low and high to the first and last 32 words from to on, where k is set
+  __attribute__((target("avx512f,avx512bw")))
+  static void AddWide(uint16_t* to, __mmask64 k, __m512i low, __m512i high) {
+    __m512i first = Load(to);
+    __m512i last = Load(to + 32);
+    Store(to, _mm512_mask_add_epi16(first, static_cast<__mmask32>(k), first, low));
+    Store(to + 32, _mm512_mask_add_epi16(last, static_cast<__mmask32>(k >> 32u), last, high));
+  }
+
+  //The bytes from from on widened to words, the first 32 of them or the last
+  __attribute__((target("avx512f,avx512bw")))
+  static __m512i Widen(const uint8_t* from) {
+    return _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(from)));
+  }
+
+  __attribute__((target("avx512f,avx512bw")))
+  static void SelectWide(uint16_t* to, __mmask64 k, uint16_t value) {
+    __m512i wide = _mm512_set1_epi16(static_cast<short>(value));
+    Store(to, _mm512_mask_blend_epi16(static_cast<__mmask32>(k), Load(to), wide));
+    Store(to + 32, _mm512_mask_blend_epi16(static_cast<__mmask32>(k >> 32u), Load(to + 32), wide));
+  }
+
+  //Store value to the bytes from to on where k is set
+  __attribute__((target("avx512f,avx512bw")))
+  static void Put(uint8_t* to, __mmask64 k, __m512i value) {
+    Store(to, _mm512_mask_blend_epi8(k, Load(to), value));
+  }
+
+  __attribute__((target("avx512f,avx512bw")))
+  static void Step(const Instruction& in, const uint8_t* mask, const LaneFields& lanes) {
+    const __m512i one = _mm512_set1_epi8(1);
+    const __m512i two = _mm512_set1_epi16(2);
+    const __m512i kk = _mm512_set1_epi8(static_cast<char>(in.kk));
+    const __m512i wrap = _mm512_set1_epi16(0x0FFF);
+    uint8_t* Vx = lanes.registers + in.x * lanes.lanes;
+    uint8_t* Vy = lanes.registers + in.y * lanes.lanes;
+    uint8_t* VF = lanes.registers + 15 * lanes.lanes;
+
+    for (unsigned int base = 0; base < lanes.lanes; base += WIDTH) {
+      uint16_t* pc = lanes.pc + base;
+      __mmask64 m = _mm512_movepi8_mask(Load(mask + base));
+      __m512i vx = Load(Vx + base);
+      __m512i vy = Load(Vy + base);
+      AddWide(pc, m, two, two);
+
+      switch (in.id) {
+        case ID_1nnn:
+          SelectWide(pc, m, in.nnn);
+          break;
+
+        case ID_3xkk:
+          AddWide(pc, _mm512_mask_cmpeq_epi8_mask(m, vx, kk), two, two);
+          break;
+
+        case ID_4xkk:
+          AddWide(pc, _mm512_mask_cmpneq_epi8_mask(m, vx, kk), two, two);
+          break;
+
+        case ID_5xy0:
+          AddWide(pc, _mm512_mask_cmpeq_epi8_mask(m, vx, vy), two, two);
+          break;
+
+        case ID_9xy0:
+          AddWide(pc, _mm512_mask_cmpneq_epi8_mask(m, vx, vy), two, two);
+          break;
+
+        case ID_6xkk:
+          Put(Vx + base, m, kk);
+          break;
+
+        case ID_7xkk:
+          Put(Vx + base, m, _mm512_add_epi8(vx, kk));
+          break;
+
+        case ID_8xy0:
+          Put(Vx + base, m, vy);
+          break;
+
+        case ID_8xy1:
+          Put(Vx + base, m, _mm512_or_si512(vx, vy));
+          break;
+
+        case ID_8xy2:
+          Put(Vx + base, m, _mm512_and_si512(vx, vy));
+          break;
+
+        case ID_8xy3:
+          Put(Vx + base, m, _mm512_xor_si512(vx, vy));
+          break;
+
+        // Flags first, then the result from Vx and Vy loaded again, as in LanesSSE2
+        case ID_8xy4:
+          Put(VF + base, m, _mm512_maskz_mov_epi8(_mm512_cmpneq_epi8_mask(_mm512_add_epi8(vx, vy),
+            _mm512_adds_epu8(vx, vy)), one));
+          Put(Vx + base, m, _mm512_add_epi8(Load(Vx + base), Load(Vy + base)));
+          break;
+
+        case ID_8xy5:
+          Put(VF + base, m, _mm512_maskz_mov_epi8(_mm512_cmpgt_epu8_mask(vx, vy), one));
+          Put(Vx + base, m, _mm512_sub_epi8(Load(Vx + base), Load(Vy + base)));
+          break;
+
+        case ID_8xy6:
+          Put(VF + base, m, _mm512_and_si512(vy, one));
+          Put(Vx + base, m, _mm512_and_si512(_mm512_srli_epi16(Load(Vy + base), 1), _mm512_set1_epi8(0x7F)));
+          break;
+
+        case ID_8xy7:
+          Put(VF + base, m, _mm512_maskz_mov_epi8(_mm512_cmpgt_epu8_mask(vy, vx), one));
+          Put(Vx + base, m, _mm512_sub_epi8(Load(Vy + base), Load(Vx + base)));
+          break;
+
+        case ID_8xyE:
+          Put(VF + base, m, _mm512_and_si512(_mm512_srli_epi16(vy, 7), one));
+          vy = Load(Vy + base);
+          Put(Vx + base, m, _mm512_add_epi8(vy, vy));
+          break;
+
+        case ID_Annn:
+          SelectWide(lanes.index + base, m, in.nnn);
+          break;
+
+        case ID_Fx07:
+          Put(Vx + base, m, Load(lanes.delayTimer + base));
+          break;
+
+        case ID_Fx15:
+          Put(lanes.delayTimer + base, m, vx);
+          break;
+
+        case ID_Fx18:
+          Put(lanes.soundTimer + base, m, vx);
+          break;
+
+        case ID_Fx1E:
+          AddWide(lanes.index + base, m, Widen(Vx + base), Widen(Vx + base + 32));
+          break;
+
+        default:
+          break;
+      }
+
+      Store(pc, _mm512_and_si512(Load(pc), wrap));
+      Store(pc + 32, _mm512_and_si512(Load(pc + 32), wrap));
+    }
+  }
+};
+#endif
+#endif
+
+/**
+ * Pick the widest lane kernel the running CPU supports, no wider than
+ * widest and dividing lanes evenly, and store its width in width. Null,
+ * with width 1, if none fits.
+ */
+LaneKernel SelectLaneKernel(unsigned int lanes, unsigned int widest, unsigned int& width) {
+#if defined(CHIP8_LANES_AVX2)
+  if (widest >= LanesAVX512::WIDTH && lanes % LanesAVX512::WIDTH == 0
+    && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    width = LanesAVX512::WIDTH;
+    return LanesAVX512::Step;
+  }
+  if (widest >= LanesAVX2::WIDTH && lanes % LanesAVX2::WIDTH == 0 && __builtin_cpu_supports("avx2")) {
+    width = LanesAVX2::WIDTH;
+    return LanesAVX2::Step;
+  }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+  if (widest >= LanesSSE2::WIDTH && lanes % LanesSSE2::WIDTH == 0) {
+    width = LanesSSE2::WIDTH;
+    return LanesSSE2::Step;
+  }
+#endif
+  (void)lanes;
+  (void)widest;
+  width = 1;
+  return nullptr;
+}
+
+/**
+ * LANES CHIP-8 machines stored structure-of-arrays: each register, pc and
+ * timer is an array with one entry per lane, so running the same
+ * instruction on many machines is a loop over contiguous bytes. Step()
+ * groups lanes that sit at the same pc on the same opcode and runs each
+ * group once under a lane mask, so machines that diverge stay correct and
+ * reconverge for free. Jumps, skips, ALU ops, Annn and the timer and Fx1E
+ * ops run as masked selects in the widest vector kernel the CPU has that
+ * divides LANES: 64 lanes to an AVX-512 vector, 32 to AVX2 or 16 to SSE2.
+ * The rest, and everything without a kernel, run as plain loops or lane
+ * by lane. Semantics match Chip8::Run() on each lane under the default
+ * quirk profile, the only one implemented; --lanes-check compares the
+ * two.
+ */
+template <unsigned int LANES>
+class Chip8Lanes {
+  public:
+    uint8_t registers[16][LANES]{};
+    uint16_t pc[LANES];
+    uint16_t index[LANES]{};
+    uint8_t sp[LANES]{};
+    uint8_t delayTimer[LANES]{};
+    uint8_t soundTimer[LANES]{};
+    uint16_t keyMask[LANES]{};    //Keys held down on each lane, bit k for key k
+    uint8_t keyWait[LANES]{};     //Lanes suspended on Fx0A, as in Chip8
+    uint8_t keyWaitRegister[LANES]{};
+    uint16_t stack[LANES][16]{};
+    uint64_t display[LANES][VIDEO_HEIGHT]{};
+    uint8_t memory[LANES][4096]{};
+
+    RngKind rngKind = RNG_LEGACY; //Generator every lane uses; set by Seed()
+    uint64_t rngState[LANES];
+
+    Chip8Lanes() {
+      memset(allLanes, 0xFF, sizeof(allLanes));
+      LimitVectorWidth(UINT_MAX);
+
+      for (unsigned int lane = 0; lane < LANES; ++lane) {
+        pc[lane] = START_ADDRESS;
+        memcpy(&memory[lane][FONTSET_START_ADDRESS], fontset, FONTSET_SIZE);
+        rngState[lane] = SeedRng(rngKind, 1);
+      }
+    }
+
+    //Load the same ROM image into every lane; false if it is too big to fit
+    bool LoadROM(const uint8_t* rom, size_t size) {
+      if (size > MAX_ROM_SIZE) {
+        return false;
+      }
+
+      for (unsigned int lane = 0; lane < LANES; ++lane) {
+        memcpy(&memory[lane][START_ADDRESS], rom, size);
+      }
+      return true;
+    }
+
+    //Load a ROM file into every lane; returns why it could not be loaded, as Chip8::LoadROM() does
+    RomError LoadROM(char const* filename) {
+      MappedRom rom;
+      RomError error = rom.Open(filename);
+      if (error == ROM_OK) {
+        LoadROM(rom.Data(), rom.Size());
+      }
+      return error;
+    }
+
+    //Reseed one lane; every lane must use the same engine
+    void Seed(unsigned int lane, uint64_t seed, RngKind engine = RNG_LEGACY) {
+      rngKind = engine;
+      rngState[lane] = SeedRng(engine, seed);
+    }
+
+    //Use vector kernels no wider than width lanes, or none below 16
+    void LimitVectorWidth(unsigned int width) {
+      kernel = SelectLaneKernel(LANES, width, vectorWidth);
+    }
+
+    //Lanes per vector in the kernel in use, 1 if there is none
+    unsigned int VectorWidth() const {
+      return vectorWidth;
+    }
+
+    //Run one instruction on every lane
+    void Step() {
+      // Lanes suspended on Fx0A spend the step waiting, or taking the
+      // lowest key once one is down
+      uint8_t pending[LANES];
+      uint8_t waiting = 0;
+      for (unsigned int lane = 0; lane < LANES; ++lane) {
+        pending[lane] = keyWait[lane] ? 0 : 0xFF;
+        waiting |= keyWait[lane];
+      }
+      for (unsigned int lane = 0; waiting && lane < LANES; ++lane) {
+        if (keyWait[lane] && keyMask[lane]) {
+          registers[keyWaitRegister[lane]][lane] = LowestBit(keyMask[lane]);
+          keyWait[lane] = 0;
+        }
+      }
+
+      // Lockstep fast path: one pc and, while no lane has written to the
+      // page, one opcode for every lane
+      uint16_t spread = 0;
+      for (unsigned int lane = 0; lane < LANES; ++lane) {
+        spread |= pc[lane] ^ pc[0];
+      }
+
+      uint16_t address = pc[0];
+      if (spread == 0 && !waiting && !((pagesWritten >> (address >> 8u)) & 1u) && (address & 0xFFu) != 0xFFu) {
+        Execute(DecodeInstruction((memory[0][address] << 8u) | memory[0][address + 1]), allLanes);
+        return;
+      }
+
+      uint16_t opcodes[LANES];
+      for (unsigned int lane = 0; lane < LANES; ++lane) {
+        opcodes[lane] = (memory[lane][pc[lane]] << 8u) | memory[lane][(pc[lane] + 1) & 0xFFFu];
+      }
+
+      for (unsigned int leader = 0; leader < LANES; ++leader) {
+        if (!pending[leader]) {
+          continue;
+        }
+
+        uint16_t groupPc = pc[leader];
+        uint16_t groupOpcode = opcodes[leader];
+        uint8_t mask[LANES];
+        for (unsigned int lane = 0; lane < LANES; ++lane) {
+          mask[lane] = pending[lane] & -static_cast<uint8_t>(pc[lane] == groupPc && opcodes[lane] == groupOpcode);
+          pending[lane] &= ~mask[lane];
+        }
+
+        Execute(DecodeInstruction(groupOpcode), mask);
+      }
+    }
+
+    void Run(uint64_t cycles) {
+      for (uint64_t i = 0; i < cycles; ++i) {
+        Step();
+      }
+    }
+
+    //Decrement every lane's timers; called at 60 Hz
+    void TickTimers() {
+      for (unsigned int lane = 0; lane < LANES; ++lane) {
+        delayTimer[lane] -= delayTimer[lane] > 0;
+        soundTimer[lane] -= soundTimer[lane] > 0;
+      }
+    }
+
+    //Run whole 60 Hz frames, as Scheduler does for a single Chip8
+    void RunFrames(uint64_t frames, unsigned int instructionsPerFrame) {
+      for (uint64_t frame = 0; frame < frames; ++frame) {
+        Run(instructionsPerFrame);
+        TickTimers();
+      }
+    }
+
+  private:
+    //Bit per 256-byte page any lane has written to, after which lanes may hold different code there
+    uint16_t pagesWritten = 0;
+
+    uint8_t allLanes[LANES];
+
+    LaneKernel kernel;
+    unsigned int vectorWidth;
+
+    void MarkWritten(unsigned int address, unsigned int length) {
+      // Writes past the end of memory wrap to its start
+      address &= 0xFFFu;
+      if (address + length > 4096) {
+        MarkWritten(0, address + length - 4096);
+        length = 4096 - address;
+      }
+      for (unsigned int page = address >> 8u; page <= ((address + length - 1) >> 8u) && page < 16; ++page) {
+        pagesWritten |= 1u << page;
+      }
+    }
+
+    static uint8_t Select(uint8_t mask, uint8_t value, uint8_t old) {
+      return (value & mask) | (old & ~mask);
+    }
+
+    //Skip the next instruction on lanes in mask where condition is non-zero
+    void SkipIf(const uint8_t* mask, const uint8_t* condition) {
+      for (unsigned int lane = 0; lane < LANES; ++lane) {
+        pc[lane] += (mask[lane] & condition[lane] & 1u) << 1u;
+      }
+    }
+
+    void Execute(const Instruction& in, const uint8_t* mask) {
+      if (kernel && LaneVectorized(in.id)) {
+        kernel(in, mask, LaneFields{registers[0], pc, index, delayTimer, soundTimer, LANES});
+        return;
+      }
+
+      const uint8_t x = in.x;
+      const uint8_t y = in.y;
+      const uint8_t kk = in.kk;
+      uint8_t* Vx = registers[x];
+      uint8_t* Vy = registers[y];
+      uint8_t* VF = registers[15];
+      uint8_t condition[LANES];
+
+      for (unsigned int lane = 0; lane < LANES; ++lane) {
+        pc[lane] += mask[lane] & 2u;
+      }
+
+      switch (in.id) {
+        case ID_1nnn:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            pc[lane] = mask[lane] ? in.nnn : pc[lane];
+          }
+          break;
+
+        case ID_3xkk:
+        case ID_4xkk:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            condition[lane] = (Vx[lane] == kk) == (in.id == ID_3xkk);
+          }
+          SkipIf(mask, condition);
+          break;
+
+        case ID_5xy0:
+        case ID_9xy0:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            condition[lane] = (Vx[lane] == Vy[lane]) == (in.id == ID_5xy0);
+          }
+          SkipIf(mask, condition);
+          break;
+
+        case ID_6xkk:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            Vx[lane] = Select(mask[lane], kk, Vx[lane]);
+          }
+          break;
+
+        case ID_7xkk:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            Vx[lane] = Select(mask[lane], Vx[lane] + kk, Vx[lane]);
+          }
+          break;
+
+        case ID_8xy0:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            Vx[lane] = Select(mask[lane], Vy[lane], Vx[lane]);
+          }
+          break;
+
+        case ID_8xy1:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            Vx[lane] = Select(mask[lane], Vx[lane] | Vy[lane], Vx[lane]);
+          }
+          break;
+
+        case ID_8xy2:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            Vx[lane] = Select(mask[lane], Vx[lane] & Vy[lane], Vx[lane]);
+          }
+          break;
+
+        case ID_8xy3:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            Vx[lane] = Select(mask[lane], Vx[lane] ^ Vy[lane], Vx[lane]);
+          }
+          break;
+
+        // The flag is written before the result, as in the Chip8 handlers,
+        // so x or y being 15 behaves the same
+        case ID_8xy4:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            VF[lane] = Select(mask[lane], Vx[lane] + Vy[lane] > 255u, VF[lane]);
+            Vx[lane] = Select(mask[lane], Vx[lane] + Vy[lane], Vx[lane]);
+          }
+          break;
+
+        case ID_8xy5:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            VF[lane] = Select(mask[lane], Vx[lane] > Vy[lane], VF[lane]);
+            Vx[lane] = Select(mask[lane], Vx[lane] - Vy[lane], Vx[lane]);
+          }
+          break;
+
+        case ID_8xy6:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            VF[lane] = Select(mask[lane], Vy[lane] & 0x1u, VF[lane]);
+            Vx[lane] = Select(mask[lane], Vy[lane] >> 1, Vx[lane]);
+          }
+          break;
+
+        case ID_8xy7:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            VF[lane] = Select(mask[lane], Vy[lane] > Vx[lane], VF[lane]);
+            Vx[lane] = Select(mask[lane], Vy[lane] - Vx[lane], Vx[lane]);
+          }
+          break;
+
+        case ID_8xyE:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            VF[lane] = Select(mask[lane], Vy[lane] >> 7u, VF[lane]);
+            Vx[lane] = Select(mask[lane], Vy[lane] << 1, Vx[lane]);
+          }
+          break;
+
+        case ID_Annn:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            index[lane] = mask[lane] ? in.nnn : index[lane];
+          }
+          break;
+
+        case ID_Bnnn:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            pc[lane] = mask[lane] ? in.nnn + registers[0][lane] : pc[lane];
+          }
+          break;
+
+        case ID_Fx07:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            Vx[lane] = Select(mask[lane], delayTimer[lane], Vx[lane]);
+          }
+          break;
+
+        case ID_Fx15:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            delayTimer[lane] = Select(mask[lane], Vx[lane], delayTimer[lane]);
+          }
+          break;
+
+        case ID_Fx18:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            soundTimer[lane] = Select(mask[lane], Vx[lane], soundTimer[lane]);
+          }
+          break;
+
+        case ID_Fx1E:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            index[lane] += mask[lane] ? Vx[lane] : 0;
+          }
+          break;
+
+        case ID_Fx29:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            index[lane] = mask[lane] ? FONTSET_START_ADDRESS + (5 * Vx[lane]) : index[lane];
+          }
+          break;
+
+        case ID_Cxkk: {
+          uint8_t bytes[LANES];
+          NextBytes(rngKind, rngState, mask, bytes, LANES);
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            Vx[lane] = Select(mask[lane], bytes[lane] & kk, Vx[lane]);
+          }
+          break;
+        }
+
+        default:
+          for (unsigned int lane = 0; lane < LANES; ++lane) {
+            if (mask[lane]) {
+              ExecuteLane(in, lane);
+            }
+          }
+          break;
+      }
+
+      // Memory wraps: stepping or jumping past its end goes on from the start
+      for (unsigned int lane = 0; lane < LANES; ++lane) {
+        pc[lane] &= 0xFFFu;
+      }
+    }
+
+    //Instructions that touch memory, the stack, the display or the keypad
+    void ExecuteLane(const Instruction& in, unsigned int lane) {
+      uint8_t value = registers[in.x][lane];
+
+      switch (in.id) {
+        case ID_00E0:
+          memset(display[lane], 0, sizeof(display[lane]));
+          break;
+
+        case ID_00EE:
+          sp[lane] = (sp[lane] - 1) & 0xFu;
+          pc[lane] = stack[lane][sp[lane]];
+          break;
+
+        case ID_2nnn:
+          stack[lane][sp[lane] & 0xFu] = pc[lane];
+          sp[lane] = (sp[lane] + 1) & 0xFu;
+          pc[lane] = in.nnn;
+          break;
+
+        case ID_Dxyn: {
+          uint8_t xPos = registers[in.x][lane] % VIDEO_WIDTH;
+          uint8_t yPos = registers[in.y][lane] % VIDEO_HEIGHT;
+          unsigned int height = std::min<unsigned int>(in.n, VIDEO_HEIGHT - yPos);
+          uint64_t collision = 0;
+
+          for (unsigned int row = 0; row < height; ++row) {
+            uint64_t sprite = (static_cast<uint64_t>(memory[lane][(index[lane] + row) & 0xFFFu]) << 56u) >> xPos;
+            collision |= display[lane][yPos + row] & sprite;
+            display[lane][yPos + row] ^= sprite;
+          }
+
+          registers[15][lane] = collision != 0;
+          break;
+        }
+
+        case ID_Ex9E:
+          pc[lane] += ((keyMask[lane] >> (value & 0xFu)) & 1u) << 1u;
+          break;
+
+        case ID_ExA1:
+          pc[lane] += (~(keyMask[lane] >> (value & 0xFu)) & 1u) << 1u;
+          break;
+
+        case ID_Fx0A:
+          if (keyMask[lane]) {
+            registers[in.x][lane] = LowestBit(keyMask[lane]);
+          } else {
+            keyWait[lane] = 1;
+            keyWaitRegister[lane] = in.x;
+          }
+          break;
+
+        case ID_Fx33:
+          memory[lane][(index[lane] + 2) & 0xFFFu] = value % 10;
+          value /= 10;
+          memory[lane][(index[lane] + 1) & 0xFFFu] = value % 10;
+          value /= 10;
+          memory[lane][index[lane] & 0xFFFu] = value % 10;
+          MarkWritten(index[lane], 3);
+          break;
+
+        case ID_Fx55:
+          for (unsigned int reg = 0; reg <= in.x; ++reg) {
+            memory[lane][(index[lane] + reg) & 0xFFFu] = registers[reg][lane];
+          }
+          MarkWritten(index[lane], in.x + 1u);
+          break;
+
+        case ID_Fx65:
+          for (unsigned int reg = 0; reg <= in.x; ++reg) {
+            registers[reg][lane] = memory[lane][(index[lane] + reg) & 0xFFFu];
+          }
+          break;
+
+        default:
+          break;
+      }
+    }
+};
+
+/**
+ * Gym-style batch of environments running the same ROM, for driving
+ * the emulator from a reinforcement learning trainer. Step() applies one
+ * action per environment and runs the requested number of frames inside
+ * the engine; Observe() writes every display into a caller-owned
+ * [count][VIDEO_HEIGHT][VIDEO_WIDTH] byte tensor, one byte (0 or 1) per
+ * pixel. Nothing is allocated after construction.
+ */
+class VecEnv {
+  public:
+    //No key held for the step
+    static const int8_t NO_ACTION = -1;
+
+    //Environments that start as copies of pristine, a machine with the ROM loaded
+    VecEnv(std::unique_ptr<Chip8> pristine, size_t count, unsigned int instructionsPerFrame, uint64_t seed)
+      : pristine(std::move(pristine)), seed(seed), episodes(count, 0) {
+      for (size_t i = 0; i < count; ++i) {
+        machines.emplace_back(new Chip8(*this->pristine));
+        schedulers.emplace_back(*machines.back(), instructionsPerFrame, false);
+        machines[i]->Seed(EpisodeSeed(i));
+      }
+    }
+
+    size_t Size() const {
+      return machines.size();
+    }
+
+    //Restart the environments where mask is non-zero, or all of them if mask is null
+    void Reset(const uint8_t* mask = nullptr) {
+      for (size_t i = 0; i < machines.size(); ++i) {
+        if (mask && !mask[i]) {
+          continue;
+        }
+        machines[i]->Reset();
+        ++episodes[i];
+        machines[i]->Seed(EpisodeSeed(i));
+      }
+    }
+
+    /**
+     * Hold key actions[i] (0-F, or NO_ACTION) on environment i for
+     * framesToSkip frames, then release it.
+     */
+    void Step(const int8_t* actions, unsigned int framesToSkip) {
+      for (size_t i = 0; i < machines.size(); ++i) {
+        Chip8& chip8 = *machines[i];
+        int8_t action = actions[i];
+
+        chip8.keyMask = action >= 0 && action < 16 ? 1u << action : 0;
+        schedulers[i].RunFrames(framesToSkip);
+        chip8.keyMask = 0;
+      }
+    }
+
+    //Write every display into observations, Size() * VIDEO_HEIGHT * VIDEO_WIDTH bytes
+    void Observe(uint8_t* observations) const {
+      for (const std::unique_ptr<Chip8>& chip8 : machines) {
+        for (unsigned int row = 0; row < VIDEO_HEIGHT; ++row) {
+          uint64_t bits = chip8->display[row];
+          for (unsigned int col = 0; col < VIDEO_WIDTH; ++col) {
+            observations[col] = (bits >> (VIDEO_WIDTH - 1 - col)) & 1u;
+          }
+          observations += VIDEO_WIDTH;
+        }
+      }
+    }
+
+    const Chip8& Machine(size_t i) const {
+      return *machines[i];
+    }
+
+  private:
+    std::unique_ptr<Chip8> pristine;
+    std::vector<std::unique_ptr<Chip8>> machines;
+    std::vector<Scheduler> schedulers;
+    uint64_t seed;
+    std::vector<uint64_t> episodes;
+
+    //Every environment and episode gets its own reproducible seed
+    uint64_t EpisodeSeed(size_t i) const {
+      return seed + episodes[i] * machines.size() + i;
+    }
+};
+
+/**
+ * Builds count environments on a ROM file, with the quirk profile
+ * CreateChip8() picks for it. Returns null if the ROM cannot be loaded,
+ * with the reason in *error if error is not null.
+ */
+std::unique_ptr<VecEnv> CreateVecEnv(char const* romFilename, size_t count, unsigned int instructionsPerFrame,
+  uint64_t seed, RomError* error = nullptr) {
+  std::unique_ptr<Chip8> pristine = CreateChip8(romFilename, seed, error);
+  if (!pristine) {
+    return nullptr;
+  }
+  return std::unique_ptr<VecEnv>(new VecEnv(std::move(pristine), count, instructionsPerFrame, seed));
+}
+
+// chip8_vecenv_create() passes RomError through as chip8_rom_error, so the two must agree
+static_assert(int(CHIP8_ROM_OK) == ROM_OK && int(CHIP8_ROM_MISSING) == ROM_MISSING
+  && int(CHIP8_ROM_NOT_REGULAR) == ROM_NOT_REGULAR && int(CHIP8_ROM_TOO_BIG) == ROM_TOO_BIG
+  && int(CHIP8_ROM_SHORT_READ) == ROM_SHORT_READ, "chip8_rom_error must match RomError");
+
+//C interface to VecEnv, declared in chip8_vecenv.h; build with CHIP8_NO_MAIN to use it as a library
+extern "C" {
+  //Returns null if the ROM cannot be loaded or the environments could not be created
+  chip8_vecenv* chip8_vecenv_create(char const* rom, size_t count, unsigned int instructionsPerFrame, uint64_t seed,
+    chip8_rom_error* error) {
+    RomError romError = ROM_OK;
+    chip8_vecenv* env = nullptr;
+    try {
+      env = reinterpret_cast<chip8_vecenv*>(CreateVecEnv(rom, count, instructionsPerFrame, seed, &romError).release());
+    } catch (...) {
+    }
+    if (error) {
+      *error = static_cast<chip8_rom_error>(romError);
+    }
+    return env;
+  }
+
+  const char* chip8_rom_error_string(chip8_rom_error error) {
+    return RomErrorText(static_cast<RomError>(error));
+  }
+
+  void chip8_vecenv_destroy(chip8_vecenv* env) {
+    delete reinterpret_cast<VecEnv*>(env);
+  }
+
+  size_t chip8_vecenv_size(const chip8_vecenv* env) {
+    return reinterpret_cast<const VecEnv*>(env)->Size();
+  }
+
+  void chip8_vecenv_reset(chip8_vecenv* env, const uint8_t* mask) {
+    reinterpret_cast<VecEnv*>(env)->Reset(mask);
+  }
+
+  void chip8_vecenv_step(chip8_vecenv* env, const int8_t* actions, unsigned int framesToSkip) {
+    reinterpret_cast<VecEnv*>(env)->Step(actions, framesToSkip);
+  }
+
+  void chip8_vecenv_observe(const chip8_vecenv* env, uint8_t* observations) {
+    reinterpret_cast<const VecEnv*>(env)->Observe(observations);
+  }
+}
+
+/**
+ * Runs task(i) for every i in [0, count) on the given number of threads.
+ * Each worker owns a contiguous range of indices and takes work from its
+ * front; a worker that runs dry steals the back half of another worker's
+ * range, so uneven task lengths still keep every core busy.
+ */
+class WorkStealingPool {
+  public:
+    explicit WorkStealingPool(unsigned int threads) : workers(threads > 0 ? threads : 1) {}
+
+    template <typename Task>
+    void ParallelFor(size_t count, Task task) {
+      size_t chunk = (count + workers.size() - 1) / workers.size();
+      for (size_t w = 0; w < workers.size(); ++w) {
+        workers[w].begin = std::min(count, w * chunk);
+        workers[w].end = std::min(count, (w + 1) * chunk);
+      }
+
+      std::vector<std::thread> threads;
+      for (size_t w = 1; w < workers.size(); ++w) {
+        threads.emplace_back([this, w, &task] { Work(w, task); });
+      }
+      Work(0, task);
+
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+    }
+
+  private:
+    struct Worker {
+      std::mutex lock;
+      size_t begin = 0;
+      size_t end = 0;
+    };
+
+    std::vector<Worker> workers;
+
+    template <typename Task>
+    void Work(size_t self, Task& task) {
+      size_t item;
+      while (Take(self, item) || Steal(self, item)) {
+        task(item);
+      }
+    }
+
+    bool Take(size_t self, size_t& item) {
+      Worker& worker = workers[self];
+      std::lock_guard<std::mutex> guard(worker.lock);
+      if (worker.begin == worker.end) {
+        return false;
+      }
+      item = worker.begin++;
+      return true;
+    }
+
+    bool Steal(size_t self, size_t& item) {
+      for (size_t offset = 1; offset < workers.size(); ++offset) {
+        Worker& victim = workers[(self + offset) % workers.size()];
+        size_t begin;
+        size_t end;
+        {
+          std::lock_guard<std::mutex> guard(victim.lock);
+          if (victim.begin == victim.end) {
+            continue;
+          }
+          end = victim.end;
+          begin = victim.begin + (victim.end - victim.begin) / 2;
+          victim.end = begin;
+        }
+
+        // Run the first stolen item now and keep the rest for later
+        Worker& worker = workers[self];
+        std::lock_guard<std::mutex> guard(worker.lock);
+        item = begin;
+        worker.begin = begin + 1;
+        worker.end = end;
+        return true;
+      }
+      return false;
+    }
+};
+
+//Map a ROM file for loading; explains on stderr and returns false if it cannot be used
+bool OpenRom(char const* filename, MappedRom& rom) {
+  RomError error = rom.Open(filename);
+  if (error != ROM_OK) {
+    std::cerr << filename << " " << RomErrorText(error) << "\n";
+    return false;
+  }
+  return true;
+}
+
+//Parse text, all of it, as a decimal number no larger than max; false if it is not one
+bool ParseNumber(char const* text, uint64_t max, uint64_t& value) {
+  char* end = nullptr;
+  errno = 0;
+  unsigned long long parsed = std::strtoull(text, &end, 10);
+  if (end == text || *end != '\0' || *text == '-' || errno == ERANGE || parsed > max) {
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
+//ParseNumber() for a command line argument; explains on stderr and returns false if it is not a number
+bool ParseArgument(char const* text, char const* name, uint64_t max, uint64_t& value) {
+  if (!ParseNumber(text, max, value)) {
+    std::cerr << name << " must be a whole number from 0 to " << max << ", not '" << text << "'\n";
+    return false;
+  }
+  return true;
+}
+
+//One headless run of a ROM
+struct BatchJob {
+  std::string rom;
+  uint64_t seed = 0;
+  uint64_t frames = 0;
+  unsigned int instructionsPerFrame = 10;
+};
+
+//Machine state at the end of a BatchJob
+struct BatchResult {
+  bool loaded = false;
+  uint64_t cycles = 0;
+  uint64_t idleCycles = 0;
+  uint64_t displayHash = 0;
+  uint8_t registers[16];
+  uint16_t index = 0;
+  uint16_t pc = 0;
+};
+
+//Runs a job on the given ROM image, which must fit in memory past 0x200
+BatchResult RunBatchJob(const BatchJob& job, const uint8_t* rom, size_t size) {
+  BatchResult result;
+  std::unique_ptr<Chip8> chip8 = CreateChip8(rom, size, job.seed);
+  if (!chip8) {
+    return result;
+  }
+
+  Scheduler scheduler(*chip8, job.instructionsPerFrame, false);
+  scheduler.RunFrames(job.frames);
+
+  result.loaded = true;
+  result.cycles = scheduler.Cycles();
+  result.idleCycles = chip8->idleCyclesSkipped;
+  result.displayHash = Fnv1a(chip8->display, sizeof(chip8->display));
+  memcpy(result.registers, chip8->registers, sizeof(result.registers));
+  result.index = chip8->index;
+  result.pc = chip8->pc;
+  return result;
+}
+
+/**
+ * Headless batch mode: reads one job per line ("<ROM> <Seed> <Frames>
+ * [InstructionsPerFrame]", # starts a comment), runs all of them across
+ * the given number of threads and prints one result line per job.
+ */
+int RunBatch(char const* jobsFilename, unsigned int threads) {
+  std::ifstream jobsFile(jobsFilename);
+  if (!jobsFile.is_open()) {
+    std::cerr << "Cannot open " << jobsFilename << "\n";
+    return EXIT_FAILURE;
+  }
+
+  std::vector<BatchJob> jobs;
+  std::string line;
+  while (std::getline(jobsFile, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    BatchJob job;
+    if (!(fields >> job.rom)) {
+      continue;
+    }
+    std::string seed, frames, rate, extra;
+    fields >> seed >> frames >> rate >> extra;
+    uint64_t instructionsPerFrame = job.instructionsPerFrame;
+    if (!ParseNumber(seed.c_str(), UINT64_MAX, job.seed) || !ParseNumber(frames.c_str(), UINT64_MAX, job.frames)
+      || (!rate.empty() && !ParseNumber(rate.c_str(), UINT_MAX, instructionsPerFrame)) || !extra.empty()) {
+      std::cerr << "Malformed job: " << line << "\n";
+      return EXIT_FAILURE;
+    }
+    job.instructionsPerFrame = static_cast<unsigned int>(instructionsPerFrame);
+    jobs.push_back(job);
+  }
+
+  // Map each ROM once; every job running it loads from the same image
+  std::map<std::string, std::unique_ptr<MappedRom>> roms;
+  for (const BatchJob& job : jobs) {
+    if (roms.count(job.rom)) {
+      continue;
+    }
+    std::unique_ptr<MappedRom> rom(new MappedRom());
+    if (!OpenRom(job.rom.c_str(), *rom)) {
+      rom.reset();
+    }
+    roms[job.rom] = std::move(rom);
+  }
+
+  std::vector<BatchResult> results(jobs.size());
+  WorkStealingPool pool(threads);
+  pool.ParallelFor(jobs.size(), [&](size_t i) {
+    const MappedRom* rom = roms.find(jobs[i].rom)->second.get();
+    if (rom) {
+      results[i] = RunBatchJob(jobs[i], rom->Data(), rom->Size());
+    }
+  });
+
+  int status = EXIT_SUCCESS;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const BatchResult& result = results[i];
+    std::cout << i << " " << jobs[i].rom;
+    if (!result.loaded) {
+      std::cout << " error=load\n";
+      status = EXIT_FAILURE;
+      continue;
+    }
+
+    std::cout << std::hex << std::setfill('0')
+      << " cycles=" << std::dec << result.cycles << " idle=" << result.idleCycles << std::hex
+      << " hash=" << std::setw(16) << result.displayHash
+      << " pc=" << std::setw(3) << result.pc
+      << " I=" << std::setw(3) << result.index
+      << " V=";
+    for (uint8_t value : result.registers) {
+      std::cout << std::setw(2) << static_cast<unsigned int>(value);
+    }
+    std::cout << std::dec << std::setfill(' ') << "\n";
+  }
+
+  return status;
+}
+
+//Hash of all machine state a replay has to reproduce
+uint64_t StateHash(const Chip8& chip8) {
+  std::string state;
+  state.append(reinterpret_cast<const char*>(chip8.registers), sizeof(chip8.registers));
+  state.append(reinterpret_cast<const char*>(chip8.memory), sizeof(chip8.memory));
+  state.append(reinterpret_cast<const char*>(&chip8.index), sizeof(chip8.index));
+  state.append(reinterpret_cast<const char*>(&chip8.pc), sizeof(chip8.pc));
+  state.append(reinterpret_cast<const char*>(chip8.stack), sizeof(chip8.stack));
+  state.push_back(static_cast<char>(chip8.sp));
+  state.push_back(static_cast<char>(chip8.delayTimer));
+  state.push_back(static_cast<char>(chip8.soundTimer));
+  state.append(reinterpret_cast<const char*>(chip8.display), sizeof(chip8.display));
+  state.push_back(static_cast<char>(chip8.keyWait));
+  state.push_back(static_cast<char>(chip8.keyWaitRegister));
+  return Fnv1a(state.data(), state.size());
+}
+
+#if defined(CHIP8_POSIX)
+//Load the --aot module made from rom; explains on stderr and returns false if it cannot be used
+bool OpenAot(char const* moduleFilename, const MappedRom& rom, Aot& aot) {
+  if (!aot.Open(moduleFilename)) {
+    std::cerr << "Cannot load " << moduleFilename << " as a recompiled ROM\n";
+    return false;
+  }
+  if (aot.RomHash() != Fnv1a(rom.Data(), rom.Size())) {
+    std::cerr << moduleFilename << " was recompiled from another ROM\n";
+    return false;
+  }
+  return true;
+}
+#endif
+
+/**
+ * Headless replay: runs a recorded session again from its input log,
+ * unthrottled, and checks that it ends in the state it was recorded in.
+ * Given a module from --aot, runs it through that instead of the Jit.
+ */
+int RunReplay(char const* romFilename, char const* logFilename, char const* moduleFilename) {
+  InputLog log;
+  if (!log.Load(logFilename)) {
+    std::cerr << "Cannot read input log " << logFilename << "\n";
+    return EXIT_FAILURE;
+  }
+
+  MappedRom rom;
+  if (!OpenRom(romFilename, rom)) {
+    return EXIT_FAILURE;
+  }
+  if (Fnv1a(rom.Data(), rom.Size()) != log.romHash) {
+    std::cerr << romFilename << " is not the ROM the session was recorded with\n";
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<Chip8> chip8(new Chip8(log.seed));
+  chip8->quirks = static_cast<QuirkProfile>(log.quirks);
+  chip8->LoadROM(rom.Data(), rom.Size());
+
+  Scheduler scheduler(*chip8, log.instructionsPerFrame, false);
+#if defined(CHIP8_JIT)
+  Jit jit(*chip8);
+  if (jit.Available()) {
+    scheduler.UseJit(&jit);
+  }
+#endif
+#if defined(CHIP8_POSIX)
+  Aot aot(*chip8);
+  if (moduleFilename) {
+    if (!OpenAot(moduleFilename, rom, aot)) {
+      return EXIT_FAILURE;
+    }
+    scheduler.UseAot(&aot);
+  }
+#else
+  if (moduleFilename) {
+    std::cerr << "Recompiled ROMs cannot be loaded on this platform\n";
+    return EXIT_FAILURE;
+  }
+#endif
+  scheduler.Replay(&log);
+
+  auto start = std::chrono::steady_clock::now();
+  scheduler.RunFrames(log.frames);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  uint64_t hash = StateHash(*chip8);
+  double recorded = static_cast<double>(log.frames) / Scheduler::FRAMES_PER_SECOND;
+  std::cout << "frames=" << scheduler.Frames() << " cycles=" << scheduler.Cycles()
+    << " idle=" << chip8->idleCyclesSkipped
+    << " events=" << log.events.size()
+    << " hash=" << std::hex << std::setfill('0') << std::setw(16) << hash << std::dec << std::setfill(' ')
+    << " speed=" << (seconds > 0 ? recorded / seconds : 0) << "x"
+    << (hash == log.finalHash ? " match" : " MISMATCH") << "\n";
+
+  return hash == log.finalHash ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+//Which part of two machines' state differs, or null if none does
+char const* StateDiffers(const Chip8State& a, const Chip8State& b) {
+  if (memcmp(a.registers, b.registers, sizeof(a.registers))) {
+    return "registers";
+  }
+  if (a.pc != b.pc || a.index != b.index) {
+    return "pc or I";
+  }
+  if (a.sp != b.sp || memcmp(a.stack, b.stack, sizeof(a.stack))) {
+    return "stack";
+  }
+  if (a.delayTimer != b.delayTimer || a.soundTimer != b.soundTimer) {
+    return "timers";
+  }
+  if (memcmp(a.memory, b.memory, sizeof(a.memory))) {
+    return "memory";
+  }
+  if (memcmp(a.display, b.display, sizeof(a.display))) {
+    return "display";
+  }
+  if (a.rng.state != b.rng.state) {
+    return "random states";
+  }
+  if (a.keyWait != b.keyWait || (a.keyWait && a.keyWaitRegister != b.keyWaitRegister)) {
+    return "key waits";
+  }
+  return nullptr;
+}
+
+//As above, between one lane of a Chip8Lanes and a Chip8
+template <unsigned int LANES>
+char const* LaneDiffers(const Chip8Lanes<LANES>& lanes, unsigned int lane, const Chip8& chip8) {
+  for (unsigned int reg = 0; reg < 16; ++reg) {
+    if (lanes.registers[reg][lane] != chip8.registers[reg]) {
+      return "registers";
+    }
+  }
+  if (lanes.pc[lane] != chip8.pc || lanes.index[lane] != chip8.index) {
+    return "pc or I";
+  }
+  if (lanes.sp[lane] != chip8.sp || memcmp(lanes.stack[lane], chip8.stack, sizeof(chip8.stack))) {
+    return "stack";
+  }
+  if (lanes.delayTimer[lane] != chip8.delayTimer || lanes.soundTimer[lane] != chip8.soundTimer) {
+    return "timers";
+  }
+  if (memcmp(lanes.memory[lane], chip8.memory, sizeof(chip8.memory))) {
+    return "memory";
+  }
+  if (memcmp(lanes.display[lane], chip8.display, sizeof(chip8.display))) {
+    return "display";
+  }
+  if (lanes.rngState[lane] != chip8.rng.state) {
+    return "random states";
+  }
+  if (lanes.keyWait[lane] != chip8.keyWait
+    || (chip8.keyWait && lanes.keyWaitRegister[lane] != chip8.keyWaitRegister)) {
+    return "key waits";
+  }
+  return nullptr;
+}
+
+/**
+ * Runs LANES machines on a ROM through Chip8Lanes and through Chip8 for
+ * RunLanesCheck(), comparing every lane after each frame, then times both
+ * engines. False on a mismatch, explained on stderr.
+ */
+template <unsigned int LANES>
+bool CheckLanes(char const* romFilename, const MappedRom& rom, uint64_t frames) {
+  const unsigned int INSTRUCTIONS_PER_FRAME = 10;
+  typedef std::chrono::steady_clock Clock;
+
+  std::unique_ptr<Chip8Lanes<LANES>> lanes;
+  std::vector<std::unique_ptr<Chip8>> machines;
+  std::vector<std::unique_ptr<Scheduler>> schedulers;
+  auto start = [&]() {
+    lanes.reset(new Chip8Lanes<LANES>());
+    lanes->LoadROM(rom.Data(), rom.Size());
+    machines.clear();
+    schedulers.clear();
+    for (unsigned int lane = 0; lane < LANES; ++lane) {
+      lanes->Seed(lane, lane + 1);
+      machines.push_back(CreateChip8(rom.Data(), rom.Size(), lane + 1));
+      schedulers.emplace_back(new Scheduler(*machines[lane], INSTRUCTIONS_PER_FRAME, false));
+    }
+  };
+
+  start();
+  for (uint64_t frame = 0; frame < frames; ++frame) {
+    lanes->RunFrames(1, INSTRUCTIONS_PER_FRAME);
+    for (unsigned int lane = 0; lane < LANES; ++lane) {
+      schedulers[lane]->RunFrame();
+
+      const Chip8& chip8 = *machines[lane];
+      char const* differs = LaneDiffers(*lanes, lane, chip8);
+      if (differs) {
+        std::cerr << romFilename << ": lane " << lane << " of " << LANES << " " << differs
+          << " differ from Chip8 after frame " << frame << " at pc=0x" << std::hex << chip8.pc << std::dec << "\n";
+        return false;
+      }
+    }
+  }
+
+  start();
+  Clock::time_point begin = Clock::now();
+  lanes->RunFrames(frames, INSTRUCTIONS_PER_FRAME);
+  Clock::time_point middle = Clock::now();
+  for (std::unique_ptr<Scheduler>& scheduler : schedulers) {
+    scheduler->RunFrames(frames);
+  }
+  Clock::time_point end = Clock::now();
+
+  const double cycles = static_cast<double>(frames * INSTRUCTIONS_PER_FRAME * LANES);
+  std::cout << std::fixed << std::setprecision(2) << romFilename << " lanes=" << LANES
+    << " vector=" << lanes->VectorWidth() << " frames=" << frames << " match lanes_mips="
+    << cycles / std::chrono::duration<double, std::micro>(middle - begin).count()
+    << " chip8_mips=" << cycles / std::chrono::duration<double, std::micro>(end - middle).count() << "\n";
+  return true;
+}
+
+/**
+ * Headless check of Chip8Lanes against Chip8: runs one machine per lane
+ * on a ROM, each with its own seed and no keys down, through both
+ * engines for the given number of frames, compares every lane with its
+ * Chip8 after each frame, then prints the throughput of both in MIPS
+ * summed over the machines. Runs 16, 32 and 64 lanes, so each vector
+ * kernel the CPU has is checked and timed. Refuses ROMs that
+ * DetectQuirks() puts on another profile than the default.
+ */
+int RunLanesCheck(char const* romFilename, uint64_t frames) {
+  MappedRom rom;
+  if (!OpenRom(romFilename, rom)) {
+    return EXIT_FAILURE;
+  }
+  if (DetectQuirks(rom.Data(), rom.Size()) != QUIRKS_DEFAULT) {
+    std::cerr << romFilename << " needs a quirk profile the lane engine does not run\n";
+    return EXIT_FAILURE;
+  }
+
+  bool passed = CheckLanes<16>(romFilename, rom, frames) && CheckLanes<32>(romFilename, rom, frames)
+    && CheckLanes<64>(romFilename, rom, frames);
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+//Keys held down in each of frames frames for the self-test: now and then one goes down or up
+std::vector<uint16_t> SelfTestKeys(std::mt19937& random, uint64_t frames) {
+  std::vector<uint16_t> keys(frames);
+  uint16_t down = 0;
+  for (uint64_t frame = 0; frame < frames; ++frame) {
+    if (random() % 8 == 0) {
+      down ^= 1u << (random() % 16);
+    }
+    keys[frame] = down;
+  }
+  return keys;
+}
+
+/**
+ * Random program of count instructions for the self-test. Every kind of
+ * instruction turns up, with operands that mostly keep to the program and
+ * to small key numbers, and now and then an idle loop or a jump anywhere
+ * in memory, past whose end pc must wrap alike in every engine.
+ */
+std::vector<uint8_t> SelfTestProgram(std::mt19937& random, unsigned int count) {
+  static const uint8_t ALU_OPS[] = {0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE};
+  static const uint8_t MISC_OPS[] = {0x07, 0x0A, 0x15, 0x18, 0x1E, 0x29, 0x33, 0x55, 0x65};
+
+  auto pick = [&](unsigned int range) {
+    return static_cast<unsigned int>(random() % range);
+  };
+  auto target = [&]() {
+    return pick(16) == 0 ? pick(0x1000) : START_ADDRESS + 2 * pick(count);
+  };
+
+  std::vector<uint16_t> opcodes;
+  while (opcodes.size() < count) {
+    unsigned int x = pick(16) << 8u;
+    unsigned int y = pick(16) << 4u;
+    unsigned int kk = pick(2) ? pick(16) : pick(256);
+    unsigned int here = START_ADDRESS + 2 * static_cast<unsigned int>(opcodes.size());
+    switch (pick(20)) {
+      case 0:
+        opcodes.push_back(pick(3) == 0 ? 0x00EE : pick(2) ? 0x00E0 : pick(0x1000));
+        break;
+      case 1:
+        opcodes.push_back(0x1000 | target());
+        break;
+      case 2:
+        opcodes.push_back(0x2000 | target());
+        break;
+      case 3:
+        opcodes.push_back(0x3000 | x | kk);
+        break;
+      case 4:
+        opcodes.push_back(0x4000 | x | kk);
+        break;
+      case 5:
+        opcodes.push_back(0x5000 | x | y | (pick(4) == 0 ? pick(16) : 0));
+        break;
+      case 6:
+      case 7:
+        opcodes.push_back(0x6000 | x | kk);
+        break;
+      case 8:
+      case 9:
+        opcodes.push_back(0x7000 | x | kk);
+        break;
+      case 10:
+      case 11:
+        opcodes.push_back(0x8000 | x | y | (pick(8) == 0 ? pick(16) : ALU_OPS[pick(sizeof(ALU_OPS))]));
+        break;
+      case 12:
+        opcodes.push_back(0x9000 | x | y | (pick(4) == 0 ? pick(16) : 0));
+        break;
+      case 13:
+        opcodes.push_back(0xA000 | (pick(4) == 0 ? pick(0x1000) : target()));
+        break;
+      case 14:
+        opcodes.push_back(0xB000 | target());
+        break;
+      case 15:
+        opcodes.push_back(0xC000 | x | pick(256));
+        break;
+      case 16:
+        opcodes.push_back(0xD000 | x | y | pick(16));
+        break;
+      case 17:
+        opcodes.push_back(0xE000 | x | (pick(2) ? 0x9E : 0xA1));
+        break;
+      case 18:
+        opcodes.push_back(0xF000 | x | (pick(8) == 0 ? pick(256) : MISC_OPS[pick(sizeof(MISC_OPS))]));
+        break;
+      default:
+        // Idle loops SkipIdle() fast-forwards: a jump to itself, or waiting for the delay timer
+        if (pick(4) == 0) {
+          opcodes.push_back(0x1000 | here);
+        } else {
+          opcodes.push_back(0x6000 | x | pick(16));
+          opcodes.push_back(0xF015 | x);
+          opcodes.push_back(0xF007 | x);
+          opcodes.push_back(0x3000 | x);
+          opcodes.push_back(0x1000 | (here + 4));
+        }
+        break;
+    }
+  }
+
+  std::vector<uint8_t> program;
+  for (unsigned int i = 0; i < count; ++i) {
+    program.push_back(static_cast<uint8_t>(opcodes[i] >> 8u));
+    program.push_back(static_cast<uint8_t>(opcodes[i]));
+  }
+  return program;
+}
+
+//A machine for the self-test with the ROM at 0x200, the given quirks and its random numbers drawn from seed
+std::unique_ptr<Chip8> SelfTestMachine(const uint8_t* rom, size_t size, QuirkProfile quirks, uint64_t seed) {
+  std::unique_ptr<Chip8> chip8(new Chip8(seed));
+  chip8->quirks = quirks;
+  chip8->LoadROM(rom, size);
+  return chip8;
+}
+
+/**
+ * Runs a program for the self-test frame by frame as Scheduler does, with
+ * keys down as given: machines stepped through Cycle() alone are the
+ * reference, which Run(), the Jit dropping flags and keeping them, the
+ * Aot module if given one and, on the default profile, LANES lanes of
+ * Chip8Lanes, with vector kernels no wider than laneWidth, must all
+ * match after every frame. For the lanes sixteen reference machines are
+ * run, seeded from seed on, and each further sixteen lanes repeat their
+ * seeds rotated by one more, so no two lanes sixteen apart run alike and
+ * a kernel mixing up the halves of a vector shows. Adds the frames run
+ * to frames. False on a mismatch, explained on stderr.
+ */
+template <unsigned int LANES>
+bool SelfTestEngines(const std::string& name, const uint8_t* rom, size_t size, QuirkProfile quirks,
+  unsigned int laneWidth, char const* moduleFilename, const std::vector<uint16_t>& keys,
+  unsigned int instructionsPerFrame, uint64_t seed, uint64_t& frames) {
+  const unsigned int REFERENCES = 16;
+  auto referenceOf = [&](unsigned int lane) {
+    return (lane + lane / REFERENCES) % REFERENCES;
+  };
+
+  std::unique_ptr<Chip8Lanes<LANES>> lanes;
+  unsigned int references = 1;
+  if (quirks == QUIRKS_DEFAULT) {
+    lanes.reset(new Chip8Lanes<LANES>());
+    lanes->LoadROM(rom, size);
+    lanes->LimitVectorWidth(laneWidth);
+    for (unsigned int lane = 0; lane < LANES; ++lane) {
+      lanes->Seed(lane, seed + referenceOf(lane));
+    }
+    references = REFERENCES;
+  }
+  std::unique_ptr<Chip8> reference[REFERENCES];
+  for (unsigned int lane = 0; lane < references; ++lane) {
+    reference[lane] = SelfTestMachine(rom, size, quirks, seed + lane);
+  }
+
+  std::vector<std::pair<char const*, std::unique_ptr<Chip8>>> engines;
+  auto add = [&](char const* engine) -> Chip8& {
+    engines.emplace_back(engine, SelfTestMachine(rom, size, quirks, seed));
+    return *engines.back().second;
+  };
+  Chip8& interpreted = add("Run()");
+#if defined(CHIP8_JIT)
+  Jit jit(add("Jit"));
+  Jit keptJit(add("Jit keeping flags"), false);
+  if (!jit.Available() || !keptJit.Available()) {
+    std::cerr << "Cannot map memory for the recompiler\n";
+    return false;
+  }
+#endif
+#if defined(CHIP8_POSIX)
+  std::unique_ptr<Aot> aot;
+  if (moduleFilename) {
+    aot.reset(new Aot(add("Aot")));
+    if (!aot->Open(moduleFilename)) {
+      std::cerr << name << ": cannot load " << moduleFilename << "\n";
+      return false;
+    }
+  }
+#else
+  (void)moduleFilename;
+#endif
+
+  for (uint64_t frame = 0; frame < keys.size(); ++frame) {
+    for (unsigned int lane = 0; lane < references; ++lane) {
+      reference[lane]->keyMask = keys[frame];
+      for (unsigned int i = 0; i < instructionsPerFrame; ++i) {
+        reference[lane]->Cycle();
+      }
+      reference[lane]->TickTimers();
+    }
+
+    for (auto& engine : engines) {
+      engine.second->keyMask = keys[frame];
+    }
+    interpreted.Run(instructionsPerFrame);
+#if defined(CHIP8_JIT)
+    jit.Run(instructionsPerFrame);
+    keptJit.Run(instructionsPerFrame);
+#endif
+#if defined(CHIP8_POSIX)
+    if (aot) {
+      aot->Run(instructionsPerFrame);
+    }
+#endif
+    for (auto& engine : engines) {
+      engine.second->TickTimers();
+    }
+    if (lanes) {
+      for (unsigned int lane = 0; lane < LANES; ++lane) {
+        lanes->keyMask[lane] = keys[frame];
+      }
+      lanes->RunFrames(1, instructionsPerFrame);
+    }
+
+    for (auto& engine : engines) {
+      char const* differs = StateDiffers(*engine.second, *reference[0]);
+      if (differs) {
+        std::cerr << name << ": " << engine.first << " " << differs << " differ from Cycle() after frame "
+          << frame << " at pc=0x" << std::hex << reference[0]->pc << std::dec << "\n";
+        return false;
+      }
+    }
+    for (unsigned int lane = 0; lane < (lanes ? LANES : 0); ++lane) {
+      const Chip8& chip8 = *reference[referenceOf(lane)];
+      char const* differs = LaneDiffers(*lanes, lane, chip8);
+      if (differs) {
+        std::cerr << name << ": Chip8Lanes lane " << lane << " " << differs << " differ from Cycle() after frame "
+          << frame << " at pc=0x" << std::hex << chip8.pc << std::dec << "\n";
+        return false;
+      }
+    }
+    ++frames;
+  }
+  return true;
+}
+
+/**
+ * Rewind round trip for the self-test: runs a program under Scheduler
+ * with keys down as given, recording every frame into rewind, then steps
+ * back halfway through what it holds, records on to the end again and
+ * steps back all the way. Each frame stepped back to must be the state
+ * saved when it was recorded, and at least minFrames must be held each
+ * time. False on a mismatch, explained on stderr.
+ */
+bool SelfTestRewind(const std::string& name, const uint8_t* rom, size_t size, QuirkProfile quirks,
+  RewindBuffer& rewind, const std::vector<uint16_t>& keys, unsigned int instructionsPerFrame, size_t minFrames) {
+  std::unique_ptr<Chip8> chip8 = SelfTestMachine(rom, size, quirks, 1);
+  Scheduler scheduler(*chip8, instructionsPerFrame, false);
+
+  std::vector<Snapshot> recorded;
+  uint64_t frame = 0;
+  for (unsigned int pass = 0; pass < 2; ++pass) {
+    for (; frame < keys.size(); ++frame) {
+      chip8->keyMask = keys[frame];
+      scheduler.RunFrame();
+      rewind.Record(*chip8);
+      recorded.emplace_back();
+      chip8->Save(recorded.back());
+    }
+
+    size_t held = rewind.Frames();
+    if (held < minFrames) {
+      std::cerr << name << ": only " << held << " frames can be rewound, not " << minFrames << "\n";
+      return false;
+    }
+    for (size_t step = pass == 0 ? held / 2 : std::max<size_t>(held, 1) - 1; step > 0; --step) {
+      if (!rewind.StepBack(*chip8)) {
+        std::cerr << name << ": cannot step back from frame " << frame << "\n";
+        return false;
+      }
+      recorded.pop_back();
+      --frame;
+
+      Snapshot state;
+      chip8->Save(state);
+      char const* differs = StateDiffers(state.state, recorded.back().state);
+      if (differs) {
+        std::cerr << name << ": " << differs << " differ from frame " << frame - 1 << " stepped back to\n";
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Reloading for the self-test: runs the first ROM under Scheduler with
+ * keys down as given, loads the second (of another size) over it, runs
+ * that and resets. Right after the load, after the reset and after
+ * running on from it, the machine must match a fresh one that only ever
+ * loaded the second ROM. False on a mismatch, explained on stderr.
+ */
+bool SelfTestReload(const std::string& name, const uint8_t* first, size_t firstSize, const uint8_t* second,
+  size_t secondSize, QuirkProfile quirks, const std::vector<uint16_t>& keys, unsigned int instructionsPerFrame) {
+  std::unique_ptr<Chip8> fresh = SelfTestMachine(second, secondSize, quirks, 1);
+  std::unique_ptr<Chip8> chip8 = SelfTestMachine(first, firstSize, quirks, 1);
+  auto run = [&](Chip8& machine) {
+    Scheduler scheduler(machine, instructionsPerFrame, false);
+    for (uint16_t down : keys) {
+      machine.keyMask = down;
+      scheduler.RunFrame();
+    }
+  };
+  auto check = [&](char const* when) {
+    char const* differs = StateDiffers(*chip8, *fresh);
+    if (differs) {
+      std::cerr << name << ": " << differs << " differ from a fresh load " << when << "\n";
+    }
+    return !differs;
+  };
+
+  run(*chip8);
+  chip8->LoadROM(second, secondSize);
+  chip8->Seed(1);
+  if (!check("after loading over another ROM")) {
+    return false;
+  }
+
+  run(*chip8);
+  chip8->Reset();
+  chip8->Seed(1);
+  if (!check("after Reset()")) {
+    return false;
+  }
+
+  run(*chip8);
+  run(*fresh);
+  return check("when run after Reset()");
+}
+
+#if defined(CHIP8_POSIX)
+/**
+ * Record and replay for the self-test: records a session of a program
+ * under Scheduler with keys down as given into an input log in directory,
+ * then checks that --replay, through the Aot module if given one, ends it
+ * in the same state.
+ */
+bool SelfTestReplay(const uint8_t* rom, size_t size, QuirkProfile quirks, const std::vector<uint16_t>& keys,
+  unsigned int instructionsPerFrame, const std::string& directory, char const* moduleFilename) {
+  const uint64_t SEED = 7;
+
+  std::string romFilename = directory + "/rom.ch8";
+  std::string logFilename = directory + "/session.log";
+  std::ofstream romFile(romFilename, std::ios::binary);
+  romFile.write(reinterpret_cast<const char*>(rom), size);
+  romFile.close();
+
+  std::unique_ptr<Chip8> chip8 = SelfTestMachine(rom, size, quirks, SEED);
+  InputLog log;
+  log.seed = SEED;
+  log.quirks = quirks;
+  log.instructionsPerFrame = instructionsPerFrame;
+  log.romHash = Fnv1a(rom, size);
+
+  Scheduler scheduler(*chip8, instructionsPerFrame, false);
+  scheduler.Record(&log);
+  for (uint16_t down : keys) {
+    chip8->keyMask = down;
+    scheduler.RunFrame();
+  }
+  log.frames = scheduler.Frames();
+  log.finalHash = StateHash(*chip8);
+
+  bool replayed = romFile && log.Save(logFilename.c_str())
+    && RunReplay(romFilename.c_str(), logFilename.c_str(), moduleFilename) == EXIT_SUCCESS;
+  unlink(romFilename.c_str());
+  unlink(logFilename.c_str());
+  return replayed;
+}
+
+/**
+ * Recompiles a ROM with WriteAotModule() and builds the module with the
+ * compiler $CXX names, or c++, into directory. Returns the module's path,
+ * or an empty string if it could not be built.
+ */
+std::string BuildAotModule(const uint8_t* rom, size_t size, const std::string& directory, unsigned int number) {
+  char const* compiler = getenv("CXX");
+  std::string source = directory + "/module" + std::to_string(number) + ".cpp";
+  std::string module = directory + "/module" + std::to_string(number) + ".so";
+
+  std::ofstream out(source);
+  std::shared_ptr<const RomImage> image = romImageCache.Get(rom, size);
+  WriteAotModule(*image, "self-test program", out);
+  out.close();
+
+  std::string command = std::string(compiler && *compiler ? compiler : "c++")
+    + " -O1 -shared -fPIC -o '" + module + "' '" + source + "' 2>/dev/null";
+  bool built = out && std::system(command.c_str()) == 0;
+  unlink(source.c_str());
+  return built ? module : std::string();
+}
+
+/**
+ * ROM loading for the self-test: checks that Chip8::LoadROM() and
+ * MappedRom::Open() give the reason a file in directory cannot be loaded,
+ * and leave memory as it was. False on a mismatch, explained on stderr.
+ */
+bool SelfTestLoad(const std::string& directory) {
+  std::string bigFilename = directory + "/big.ch8";
+  std::ofstream(bigFilename, std::ios::binary) << std::string(MAX_ROM_SIZE + 1, '\x12');
+
+  struct Load {
+    std::string filename;
+    RomError expected;
+  };
+  const Load loads[] = {
+    {directory + "/missing.ch8", ROM_MISSING},
+    {directory, ROM_NOT_REGULAR},
+    {bigFilename, ROM_TOO_BIG}
+  };
+
+  bool passed = true;
+  for (const Load& load : loads) {
+    Chip8 chip8;
+    MappedRom rom;
+    RomError loaded = chip8.LoadROM(load.filename.c_str());
+    RomError opened = rom.Open(load.filename.c_str());
+    if (loaded != load.expected || opened != load.expected || chip8.memory[START_ADDRESS] != 0) {
+      std::cerr << load.filename << " " << RomErrorText(loaded) << " and " << RomErrorText(opened)
+        << " rather than " << RomErrorText(load.expected) << "\n";
+      passed = false;
+    }
+  }
+  unlink(bigFilename.c_str());
+  return passed;
+}
+#endif
+
+/**
+ * Batch runs for the self-test: runs every ROM as a job on a
+ * WorkStealingPool of several threads and again one at a time, and checks
+ * that each job ends the same both ways. False on a mismatch, explained on
+ * stderr.
+ */
+bool SelfTestBatch(const std::vector<std::vector<uint8_t>>& roms, uint64_t frames) {
+  const unsigned int THREADS = 4;
+
+  std::vector<BatchJob> jobs(roms.size());
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    jobs[i].seed = i;
+    jobs[i].frames = frames;
+  }
+
+  std::vector<BatchResult> results(jobs.size());
+  WorkStealingPool pool(THREADS);
+  pool.ParallelFor(jobs.size(), [&](size_t i) {
+    results[i] = RunBatchJob(jobs[i], roms[i].data(), roms[i].size());
+  });
+
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    BatchResult alone = RunBatchJob(jobs[i], roms[i].data(), roms[i].size());
+    const BatchResult& pooled = results[i];
+    if (alone.loaded != pooled.loaded || alone.cycles != pooled.cycles || alone.idleCycles != pooled.idleCycles
+      || alone.displayHash != pooled.displayHash || alone.index != pooled.index || alone.pc != pooled.pc
+      || memcmp(alone.registers, pooled.registers, sizeof(alone.registers)) != 0) {
+      std::cerr << "batch job " << i << " ends differently on " << THREADS << " threads than alone\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Headless self-test of the engines against each other: random programs
+ * under every quirk profile, then any ROMs given under the profile
+ * DetectQuirks() picks, each run through every engine by
+ * SelfTestEngines(), rewound by SelfTestRewind() and loaded over by half
+ * of itself in SelfTestReload(), and all of them as one batch by
+ * SelfTestBatch(). A few of them, and every ROM, are also recorded and
+ * replayed by SelfTestReplay(), and on the default profile run through
+ * Aot modules built for them; if no module can be built, Aot is left out
+ * with a note. The random programs take turns at running Chip8Lanes with
+ * each vector kernel width and with plain loops. Rewinding is also
+ * checked on deltas that fill the rewind buffer's arena exactly.
+ */
+int RunSelfTest(char** romFilenames, int count) {
+  const unsigned int PROGRAMS = 256;         //Random programs per quirk profile
+  const unsigned int DEEP_PROGRAMS = 4;      //Of those, replayed and, on the default profile, recompiled
+  const unsigned int PROGRAM_INSTRUCTIONS = 128;
+  const uint64_t PROGRAM_FRAMES = 600;
+  const uint64_t ROM_FRAMES = 20000;
+  const uint64_t ROM_REWIND_FRAMES = 600;
+  const unsigned int ROM_INSTRUCTIONS_PER_FRAME = 15;
+  const uint64_t BATCH_FRAMES = 600;
+
+  struct Case {
+    std::string name;
+    std::vector<uint8_t> rom;
+    QuirkProfile quirks;
+    unsigned int laneWidth;
+    unsigned int instructionsPerFrame;
+    std::vector<uint16_t> keys;
+    bool deep;
+  };
+
+  std::mt19937 random(1);
+  std::vector<Case> cases;
+  for (unsigned int profile = QUIRKS_DEFAULT; profile <= QUIRKS_XOCHIP; ++profile) {
+    for (unsigned int i = 0; i < PROGRAMS; ++i) {
+      Case program;
+      program.name = "random program " + std::to_string(i) + " of profile " + std::to_string(profile);
+      program.rom = SelfTestProgram(random, PROGRAM_INSTRUCTIONS);
+      program.quirks = static_cast<QuirkProfile>(profile);
+      program.laneWidth = 64 >> (i % 4);
+      program.instructionsPerFrame = 1 + random() % 64;
+      program.keys = SelfTestKeys(random, PROGRAM_FRAMES);
+      program.deep = i < DEEP_PROGRAMS;
+      cases.push_back(std::move(program));
+    }
+  }
+  for (int i = 0; i < count; ++i) {
+    MappedRom rom;
+    if (!OpenRom(romFilenames[i], rom)) {
+      return EXIT_FAILURE;
+    }
+    Case file;
+    file.name = romFilenames[i];
+    file.rom.assign(rom.Data(), rom.Data() + rom.Size());
+    file.quirks = DetectQuirks(rom.Data(), rom.Size());
+    file.laneWidth = 16;
+    file.instructionsPerFrame = ROM_INSTRUCTIONS_PER_FRAME;
+    file.keys = SelfTestKeys(random, ROM_FRAMES);
+    file.deep = true;
+    cases.push_back(std::move(file));
+  }
+
+#if defined(CHIP8_POSIX)
+  char directoryTemplate[] = "/tmp/chip8-selftest-XXXXXX";
+  if (!mkdtemp(directoryTemplate)) {
+    std::cerr << "Cannot make a temporary directory\n";
+    return EXIT_FAILURE;
+  }
+  std::string directory = directoryTemplate;
+  bool canBuild = true;
+#endif
+
+  bool passed = true;
+  uint64_t frames = 0;
+  unsigned int rewound = 0;
+  unsigned int reloaded = 0;
+  unsigned int modules = 0;
+  for (const Case& test : cases) {
+    const uint8_t* rom = test.rom.data();
+    size_t size = test.rom.size();
+
+    std::string module;
+#if defined(CHIP8_POSIX)
+    if (test.deep && test.quirks == QUIRKS_DEFAULT && canBuild) {
+      module = BuildAotModule(rom, size, directory, modules);
+      canBuild = !module.empty();
+      modules += canBuild;
+      if (!canBuild) {
+        std::cerr << "Cannot build Aot modules with " << (getenv("CXX") ? getenv("CXX") : "c++")
+          << "; leaving Aot out\n";
+      }
+    }
+#endif
+
+    // As many lanes as the widest kernel takes, so each kernel runs on every lane it can
+    auto engines = test.laneWidth >= 64 ? SelfTestEngines<64> : test.laneWidth >= 32 ? SelfTestEngines<32>
+      : SelfTestEngines<16>;
+    passed = engines(test.name, rom, size, test.quirks, test.laneWidth, module.empty() ? nullptr : module.c_str(),
+      test.keys, test.instructionsPerFrame, 1, frames);
+
+    if (passed) {
+      std::vector<uint16_t> keys(test.keys.begin(),
+        test.keys.begin() + std::min<uint64_t>(test.keys.size(), ROM_REWIND_FRAMES));
+      RewindBuffer rewind(64, 8, 4096);
+      passed = SelfTestRewind(test.name, rom, size, test.quirks, rewind, keys, test.instructionsPerFrame, 0);
+      ++rewound;
+
+      // Half the ROM leaves the tail of the whole one behind in memory unless loading clears it
+      if (passed) {
+        passed = SelfTestReload(test.name, rom, size, rom, size / 2, test.quirks, keys, test.instructionsPerFrame);
+        ++reloaded;
+      }
+
+#if defined(CHIP8_POSIX)
+      if (passed && test.deep) {
+        passed = SelfTestReplay(rom, size, test.quirks, keys, test.instructionsPerFrame, directory,
+          module.empty() ? nullptr : module.c_str());
+      }
+#endif
+    }
+
+#if defined(CHIP8_POSIX)
+    if (!module.empty()) {
+      unlink(module.c_str());
+    }
+#endif
+    if (!passed) {
+      break;
+    }
+  }
+
+  // A counter's deltas are 12 bytes each, so eight of them fill a 96-byte arena exactly
+  if (passed) {
+    static const uint8_t COUNTER[] = {0x70, 0x01, 0x12, 0x00};
+    RewindBuffer rewind(64, 1000, 96);
+    passed = SelfTestRewind("counter", COUNTER, sizeof(COUNTER), QUIRKS_DEFAULT, rewind,
+      std::vector<uint16_t>(40), 10, 8);
+    ++rewound;
+  }
+
+#if defined(CHIP8_POSIX)
+  passed = passed && SelfTestLoad(directory);
+  rmdir(directory.c_str());
+#endif
+  if (!passed) {
+    return EXIT_FAILURE;
+  }
+
+  std::vector<std::vector<uint8_t>> roms;
+  for (const Case& test : cases) {
+    roms.push_back(test.rom);
+  }
+  if (!SelfTestBatch(roms, BATCH_FRAMES)) {
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "programs=" << cases.size() << " frames=" << frames << " rewound=" << rewound
+    << " reloaded=" << reloaded << " batched=" << roms.size() << " aot_modules=" << modules << " match\n";
+  return EXIT_SUCCESS;
+}
+
+/**
+ * One instruction of a benchmark program. REPEAT places opcode as is;
+ * CHAIN adds the address of the next instruction, for jumps that go
+ * straight on (1nnn, and Bnnn with V0 = 0); OVER adds the address of the
+ * one after that, for a 2nnn calling a 00EE just past a jump over it.
+ */
+struct BenchOp {
+  enum Kind : uint8_t {REPEAT, CHAIN, OVER};
+
+  char const* name;
+  uint16_t opcode;
+  Kind kind;
+};
+
+/**
+ * Machine for a benchmark program: pattern repeated as many whole times
+ * as fit in 1024 instructions from 0x200, then jumps back to 0x200 (two,
+ * in case the last instruction skips). Registers hold their own index,
+ * I points at the font and key 3 is down, so that every skip in the
+ * patterns below is not taken and Fx0A does not wait.
+ */
+std::unique_ptr<Chip8> BenchMachine(const BenchOp* pattern, size_t count) {
+  const unsigned int INSTRUCTIONS = 1024;
+
+  std::vector<uint8_t> rom;
+  for (unsigned int i = 0; i < INSTRUCTIONS - INSTRUCTIONS % count; ++i) {
+    const BenchOp& op = pattern[i % count];
+    uint16_t address = START_ADDRESS + 2 * i;
+    uint16_t opcode = op.opcode;
+    if (op.kind == BenchOp::CHAIN) {
+      opcode |= address + 2;
+    } else if (op.kind == BenchOp::OVER) {
+      opcode |= address + 4;
+    }
+    rom.push_back(opcode >> 8u);
+    rom.push_back(opcode & 0xFFu);
+  }
+  for (unsigned int i = 0; i < 2; ++i) {
+    rom.push_back(0x10u | (START_ADDRESS >> 8u));
+    rom.push_back(START_ADDRESS & 0xFFu);
+  }
+
+  std::unique_ptr<Chip8> chip8(new Chip8(1));
+  chip8->LoadROM(rom.data(), rom.size());
+  for (unsigned int i = 0; i < 16; ++i) {
+    chip8->registers[i] = i;
+  }
+  chip8->index = FONTSET_START_ADDRESS;
+  chip8->keyMask = 1u << 3;
+  return chip8;
+}
+
+//Best of a few runs of cycles instructions, in nanoseconds per instruction
+template <typename Step>
+double BenchTime(uint64_t cycles, Step step) {
+  const unsigned int REPEATS = 5;
+
+  double best = 0;
+  for (unsigned int repeat = 0; repeat < REPEATS; ++repeat) {
+    auto start = std::chrono::steady_clock::now();
+    step(cycles);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (repeat == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  return best * 1e9 / cycles;
+}
+
+//Cost per instruction of pattern through Cycle() and through Run()
+void BenchPattern(const BenchOp* pattern, size_t count, double& cycleNs, double& runNs) {
+  const uint64_t CYCLES = 1u << 21;
+
+  std::unique_ptr<Chip8> chip8 = BenchMachine(pattern, count);
+  cycleNs = BenchTime(CYCLES, [&](uint64_t cycles) {
+    for (uint64_t i = 0; i < cycles; ++i) {
+      chip8->Cycle();
+    }
+  });
+
+  chip8 = BenchMachine(pattern, count);
+  runNs = BenchTime(CYCLES, [&](uint64_t cycles) { chip8->Run(cycles); });
+}
+
+//Instructions per 60 Hz frame when timing a ROM
+const unsigned int BENCH_FRAME_CYCLES = 1000;
+
+/**
+ * Run cycles instructions of a ROM being timed in frames, ticking the
+ * timers after each as Scheduler does, so a ROM waiting on the delay
+ * timer gets past the wait as it would when played. Idle loops are run
+ * rather than skipped, so every instruction counted is one executed,
+ * save cycles a machine spends suspended on Fx0A.
+ */
+template <typename Run>
+void BenchFrames(Chip8& chip8, uint64_t cycles, Run run) {
+  chip8.skipIdle = false;
+  for (uint64_t done = 0; done < cycles; done += BENCH_FRAME_CYCLES) {
+    run(std::min<uint64_t>(BENCH_FRAME_CYCLES, cycles - done));
+    chip8.TickTimers();
+  }
+}
+
+//text as a JSON string, quoted, with quotes, backslashes and control characters escaped
+std::string JsonString(const std::string& text) {
+  std::ostringstream out;
+  out << '"' << std::hex << std::setfill('0');
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      out << "\\u" << std::setw(4) << static_cast<unsigned int>(c);
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+  return out.str();
+}
+
+/**
+ * Headless interpreter benchmark, printed as JSON: the cost of each
+ * opcode family run on its own, of Cycle() and Run() over instruction
+ * mixes heavy in ALU, drawing, branching or calls, and, given a ROM, the
+ * throughput on it in MIPS, also through its --aot module if given one.
+ */
+int RunBench(char const* romFilename, char const* moduleFilename) {
+  static const BenchOp OPCODES[] = {
+    {"0nnn", 0x0123, BenchOp::REPEAT}, {"00E0", 0x00E0, BenchOp::REPEAT},
+    {"1nnn", 0x1000, BenchOp::CHAIN}, {"3xkk", 0x31FF, BenchOp::REPEAT},
+    {"4xkk", 0x4101, BenchOp::REPEAT},
+    {"5xy0", 0x5120, BenchOp::REPEAT}, {"6xkk", 0x6142, BenchOp::REPEAT},
+    {"7xkk", 0x7101, BenchOp::REPEAT}, {"8xy0", 0x8120, BenchOp::REPEAT},
+    {"8xy1", 0x8121, BenchOp::REPEAT}, {"8xy2", 0x8122, BenchOp::REPEAT},
+    {"8xy3", 0x8123, BenchOp::REPEAT}, {"8xy4", 0x8124, BenchOp::REPEAT},
+    {"8xy5", 0x8125, BenchOp::REPEAT}, {"8xy6", 0x8126, BenchOp::REPEAT},
+    {"8xy7", 0x8127, BenchOp::REPEAT}, {"8xyE", 0x812E, BenchOp::REPEAT},
+    {"9xy0", 0x9110, BenchOp::REPEAT}, {"Annn", 0xA050, BenchOp::REPEAT},
+    {"Bnnn", 0xB000, BenchOp::CHAIN}, {"Cxkk", 0xC1FF, BenchOp::REPEAT},
+    {"Dxyn", 0xD125, BenchOp::REPEAT}, {"Ex9E", 0xE19E, BenchOp::REPEAT},
+    {"ExA1", 0xE3A1, BenchOp::REPEAT}, {"Fx07", 0xF107, BenchOp::REPEAT},
+    {"Fx0A", 0xF10A, BenchOp::REPEAT}, {"Fx15", 0xF115, BenchOp::REPEAT},
+    {"Fx18", 0xF118, BenchOp::REPEAT}, {"Fx1E", 0xF01E, BenchOp::REPEAT},
+    {"Fx29", 0xF129, BenchOp::REPEAT}, {"Fx33", 0xF133, BenchOp::REPEAT},
+    {"Fx55", 0xF355, BenchOp::REPEAT}, {"Fx65", 0xF365, BenchOp::REPEAT}
+  };
+
+  // Skips compare V5-V7, which the mixes never change
+  static const BenchOp ALU_MIX[] = {
+    {"", 0x6113, BenchOp::REPEAT}, {"", 0x7207, BenchOp::REPEAT}, {"", 0x8124, BenchOp::REPEAT},
+    {"", 0x8315, BenchOp::REPEAT}, {"", 0x8232, BenchOp::REPEAT}, {"", 0x8416, BenchOp::REPEAT},
+    {"", 0x8341, BenchOp::REPEAT}, {"", 0x812E, BenchOp::REPEAT}, {"", 0x8423, BenchOp::REPEAT},
+    {"", 0x3500, BenchOp::REPEAT}
+  };
+  static const BenchOp DRAW_MIX[] = {
+    {"", 0xF129, BenchOp::REPEAT}, {"", 0xD235, BenchOp::REPEAT}, {"", 0x7204, BenchOp::REPEAT},
+    {"", 0xA050, BenchOp::REPEAT}, {"", 0xD345, BenchOp::REPEAT}, {"", 0x7305, BenchOp::REPEAT},
+    {"", 0xD125, BenchOp::REPEAT}, {"", 0x00E0, BenchOp::REPEAT}
+  };
+  static const BenchOp BRANCH_MIX[] = {
+    {"", 0x35FF, BenchOp::REPEAT}, {"", 0x1000, BenchOp::CHAIN}, {"", 0x4505, BenchOp::REPEAT},
+    {"", 0x5560, BenchOp::REPEAT}, {"", 0x9550, BenchOp::REPEAT}, {"", 0xB000, BenchOp::CHAIN},
+    {"", 0x7101, BenchOp::REPEAT}
+  };
+  // Call the 00EE two on, which returns to the jump past it
+  static const BenchOp CALL_MIX[] = {
+    {"", 0x2000, BenchOp::OVER}, {"", 0x1000, BenchOp::OVER}, {"", 0x00EE, BenchOp::REPEAT}
+  };
+  struct Mix {
+    char const* name;
+    const BenchOp* pattern;
+    size_t count;
+  };
+  static const Mix MIXES[] = {
+    {"alu", ALU_MIX, sizeof(ALU_MIX) / sizeof(ALU_MIX[0])},
+    {"draw", DRAW_MIX, sizeof(DRAW_MIX) / sizeof(DRAW_MIX[0])},
+    {"branch", BRANCH_MIX, sizeof(BRANCH_MIX) / sizeof(BRANCH_MIX[0])},
+    {"call", CALL_MIX, sizeof(CALL_MIX) / sizeof(CALL_MIX[0])}
+  };
+
+  MappedRom rom;
+  if (romFilename && !OpenRom(romFilename, rom)) {
+    return EXIT_FAILURE;
+  }
+#if defined(CHIP8_POSIX)
+  std::unique_ptr<Chip8> aotChip8;
+  std::unique_ptr<Aot> aot;
+  if (moduleFilename) {
+    aotChip8 = CreateChip8(rom.Data(), rom.Size(), 1);
+    aot.reset(new Aot(*aotChip8));
+    if (!OpenAot(moduleFilename, rom, *aot)) {
+      return EXIT_FAILURE;
+    }
+  }
+#else
+  if (moduleFilename) {
+    std::cerr << "Recompiled ROMs cannot be loaded on this platform\n";
+    return EXIT_FAILURE;
+  }
+#endif
+
+  std::cout << std::fixed << std::setprecision(2) << "{\n  \"opcodes\": [";
+  for (size_t i = 0; i < sizeof(OPCODES) / sizeof(OPCODES[0]); ++i) {
+    double cycleNs, runNs;
+    BenchPattern(&OPCODES[i], 1, cycleNs, runNs);
+    std::cout << (i ? "," : "") << "\n    {\"op\": \"" << OPCODES[i].name
+      << "\", \"cycle_ns\": " << cycleNs << ", \"run_ns\": " << runNs << "}";
+  }
+
+  std::cout << "\n  ],\n  \"mixes\": [";
+  for (size_t i = 0; i < sizeof(MIXES) / sizeof(MIXES[0]); ++i) {
+    double cycleNs, runNs;
+    BenchPattern(MIXES[i].pattern, MIXES[i].count, cycleNs, runNs);
+    std::cout << (i ? "," : "") << "\n    {\"mix\": \"" << MIXES[i].name
+      << "\", \"cycle_mips\": " << 1e3 / cycleNs << ", \"run_mips\": " << 1e3 / runNs << "}";
+  }
+  std::cout << "\n  ]";
+
+  if (romFilename) {
+    const uint64_t CYCLES = 1u << 24;
+
+    std::unique_ptr<Chip8> chip8 = CreateChip8(rom.Data(), rom.Size(), 1);
+    double cycleNs = BenchTime(CYCLES, [&](uint64_t cycles) {
+      BenchFrames(*chip8, cycles, [&](uint64_t frameCycles) {
+        for (uint64_t i = 0; i < frameCycles; ++i) {
+          chip8->Cycle();
+        }
+      });
+    });
+    chip8 = CreateChip8(rom.Data(), rom.Size(), 1);
+    double runNs = BenchTime(CYCLES, [&](uint64_t cycles) {
+      BenchFrames(*chip8, cycles, [&](uint64_t frameCycles) { chip8->Run(frameCycles); });
+    });
+
+    std::cout << ",\n  \"rom\": {\"file\": " << JsonString(romFilename) << ", \"bytes\": " << rom.Size()
+      << ", \"cycle_mips\": " << 1e3 / cycleNs << ", \"run_mips\": " << 1e3 / runNs;
+#if defined(CHIP8_JIT)
+    chip8 = CreateChip8(rom.Data(), rom.Size(), 1);
+    Jit jit(*chip8);
+    if (jit.Available()) {
+      double jitNs = BenchTime(CYCLES, [&](uint64_t cycles) {
+        BenchFrames(*chip8, cycles, [&](uint64_t frameCycles) { jit.Run(frameCycles); });
+      });
+      std::cout << ", \"jit_mips\": " << 1e3 / jitNs;
+    }
+#endif
+#if defined(CHIP8_POSIX)
+    if (aot) {
+      double aotNs = BenchTime(CYCLES, [&](uint64_t cycles) {
+        BenchFrames(*aotChip8, cycles, [&](uint64_t frameCycles) { aot->Run(frameCycles); });
+      });
+      std::cout << ", \"aot_mips\": " << 1e3 / aotNs;
+    }
+#endif
+    std::cout << "}";
+  }
+  std::cout << "\n}\n";
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Benchmark of dead flag elimination over a corpus of ROMs, best run on
+ * ALU-heavy ones: each runs through the Jit keeping every flag, then
+ * dropping those DeadFlags() finds, and the MIPS of both are printed.
+ */
+int RunFlagBench(char** romFilenames, int count) {
+#if defined(CHIP8_JIT)
+  const uint64_t CYCLES = 1u << 24;
+
+  double keptTotal = 0;
+  double droppedTotal = 0;
+  for (int i = 0; i < count; ++i) {
+    MappedRom rom;
+    if (!OpenRom(romFilenames[i], rom)) {
+      return EXIT_FAILURE;
+    }
+
+    double ns[2];
+    for (int drop = 0; drop < 2; ++drop) {
+      std::unique_ptr<Chip8> chip8 = CreateChip8(rom.Data(), rom.Size(), 1);
+      Jit jit(*chip8, drop != 0);
+      if (!jit.Available()) {
+        std::cerr << "Cannot map memory for the recompiler\n";
+        return EXIT_FAILURE;
+      }
+      ns[drop] = BenchTime(CYCLES, [&](uint64_t cycles) {
+        BenchFrames(*chip8, cycles, [&](uint64_t frameCycles) { jit.Run(frameCycles); });
+      });
+    }
+
+    keptTotal += ns[0];
+    droppedTotal += ns[1];
+    std::cout << std::fixed << std::setprecision(2) << romFilenames[i]
+      << " kept_mips=" << 1e3 / ns[0] << " dropped_mips=" << 1e3 / ns[1]
+      << " speedup=" << ns[0] / ns[1] << "\n";
+  }
+  if (count > 1) {
+    std::cout << "total speedup=" << keptTotal / droppedTotal << "\n";
+  }
+  return EXIT_SUCCESS;
+#else
+  (void)romFilenames;
+  (void)count;
+  std::cerr << "The flag benchmark needs the x86-64 recompiler\n";
+  return EXIT_FAILURE;
+#endif
+}
+
+/**
+ * Headless benchmark of restarting a machine on a ROM: runs a few cycles
+ * to dirty its state, then restarts it with Reset(), ResetFrom() of a
+ * snapshot saved after loading, or by building a new one, and prints
+ * restarts per second for each.
+ */
+int RunResetBench(char const* romFilename, unsigned long count) {
+  const uint64_t CYCLES_PER_RESET = 64;
+
+  MappedRom rom;
+  if (!OpenRom(romFilename, rom)) {
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<Chip8> chip8 = CreateChip8(rom.Data(), rom.Size(), 1);
+  Snapshot start;
+  chip8->Save(start);
+
+  char const* const methods[] = {"Reset", "ResetFrom", "CreateChip8"};
+  for (unsigned int method = 0; method < 3; ++method) {
+    auto begin = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < count; ++i) {
+      chip8->Run(CYCLES_PER_RESET);
+      if (method == 0) {
+        chip8->Reset();
+      } else if (method == 1) {
+        chip8->ResetFrom(start);
+      } else {
+        chip8 = CreateChip8(rom.Data(), rom.Size(), 1);
+      }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << methods[method] << " resets/s=" << (seconds > 0 ? count / seconds : 0) << "\n";
+  }
+
+  return EXIT_SUCCESS;
+}
+
+//Handler names and whether each takes the quirk profile, in handler id order
+char const* const opNames[ID_COUNT] = {
+#define CHIP8_OP_NAME(name) #name,
+  CHIP8_OPS(CHIP8_OP_NAME)
+#undef CHIP8_OP_NAME
+};
+
+constexpr bool opQuirked[ID_COUNT] = {
+#define CHIP8_OP_PLAIN(name) false,
+#define CHIP8_OP_QUIRKED(name) true,
+  CHIP8_OPS_QUIRKED(CHIP8_OP_PLAIN, CHIP8_OP_QUIRKED)
+#undef CHIP8_OP_QUIRKED
+#undef CHIP8_OP_PLAIN
+};
+
+//Whether a handler can come before another in a superinstruction: it
+//neither writes memory, always leaves the straight-line path nor can
+//suspend the machine on a key wait
+constexpr bool FusableBefore(uint8_t id) {
+  return id != ID_NULL && id != ID_00EE && id != ID_1nnn && id != ID_2nnn &&
+    id != ID_Bnnn && id != ID_Fx0A && id != ID_Fx33 && id != ID_Fx55;
+}
+
+/**
+ * Mines ROMs for superinstructions: runs each through Cycle() for the
+ * given number of cycles, ticking the timers every frame and pressing
+ * random keys now and then, and counts the handler pairs and triples
+ * executed back to back. The most frequent are printed as definitions of
+ * CHIP8_FUSED_TRIPLES and CHIP8_FUSED_PAIRS, each after a comment with
+ * its share of all instructions executed.
+ */
+int RunMine(uint64_t cycles, char** romFilenames, int count) {
+  const unsigned int INSTRUCTIONS_PER_FRAME = 10;
+  const size_t MAX_TRIPLES = 4;
+  const size_t MAX_PAIRS = 8;
+
+  std::vector<uint64_t> pairs(ID_COUNT * ID_COUNT);
+  std::vector<uint64_t> triples(ID_COUNT * ID_COUNT * ID_COUNT);
+  uint64_t total = 0;
+  std::minstd_rand keys(1);
+
+  for (int rom = 0; rom < count; ++rom) {
+    RomError error = ROM_OK;
+    std::unique_ptr<Chip8> chip8 = CreateChip8(romFilenames[rom], 1, &error);
+    if (!chip8) {
+      std::cerr << romFilenames[rom] << " " << RomErrorText(error) << "\n";
+      return EXIT_FAILURE;
+    }
+
+    //The last two handlers run straight through, most recent last
+    uint8_t run[2] = {};
+    unsigned int length = 0;
+    uint16_t next = 0;
+    for (uint64_t i = 0; i < cycles && chip8->pc < 4095; ++i) {
+      if (i % INSTRUCTIONS_PER_FRAME == 0) {
+        chip8->TickTimers();
+        if (keys() % 16 == 0) {
+          unsigned int key = keys() % 16;
+          chip8->keyMask = (keys() % 2) << key;
+        }
+      }
+
+      // A cycle spent suspended on Fx0A runs no instruction
+      if (chip8->keyWait) {
+        chip8->Cycle();
+        length = 0;
+        continue;
+      }
+
+      uint8_t id = OpIdAt(chip8->memory, chip8->pc);
+      length = chip8->pc == next ? length : 0;
+      if (length >= 1 && FusableBefore(run[1])) {
+        ++pairs[run[1] * ID_COUNT + id];
+        if (length >= 2 && FusableBefore(run[0])) {
+          ++triples[(run[0] * ID_COUNT + run[1]) * ID_COUNT + id];
+        }
+      }
+      run[0] = run[1];
+      run[1] = id;
+      length = std::min(length + 1, 2u);
+      next = chip8->pc + 2;
+
+      chip8->Cycle();
+      ++total;
+    }
+  }
+
+  //Ranked by count, largest first
+  auto ranked = [](const std::vector<uint64_t>& counts, size_t limit) {
+    std::vector<size_t> order;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      if (counts[i]) {
+        order.push_back(i);
+      }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return counts[a] > counts[b]; });
+    order.resize(std::min(order.size(), limit));
+    return order;
+  };
+  auto share = [&](uint64_t n) { return total ? 100.0 * n / total : 0.0; };
+  auto call = [](size_t id) {
+    return std::string("OP_") + opNames[id] + (opQuirked[id] ? "<Q>()" : "()");
+  };
+
+  std::vector<size_t> topTriples = ranked(triples, MAX_TRIPLES);
+  std::vector<size_t> topPairs = ranked(pairs, MAX_PAIRS);
+
+  std::cout << std::fixed << std::setprecision(2) << "//" << total << " instructions\n//";
+  for (size_t i : topTriples) {
+    std::cout << " " << opNames[i / (ID_COUNT * ID_COUNT)] << "+" << opNames[i / ID_COUNT % ID_COUNT]
+      << "+" << opNames[i % ID_COUNT] << " " << share(triples[i]) << "%";
+  }
+  std::cout << "\n#define CHIP8_FUSED_TRIPLES(X)";
+  for (size_t i : topTriples) {
+    size_t a = i / (ID_COUNT * ID_COUNT), b = i / ID_COUNT % ID_COUNT, c = i % ID_COUNT;
+    std::cout << " \\\n  X(" << opNames[a] << ", " << opNames[b] << ", " << opNames[c] << ", "
+      << call(a) << ", " << call(b) << ", " << call(c) << ")";
+  }
+
+  std::cout << "\n\n//";
+  for (size_t i : topPairs) {
+    std::cout << " " << opNames[i / ID_COUNT] << "+" << opNames[i % ID_COUNT] << " " << share(pairs[i]) << "%";
+  }
+  std::cout << "\n#define CHIP8_FUSED_PAIRS(X)";
+  for (size_t i : topPairs) {
+    size_t a = i / ID_COUNT, b = i % ID_COUNT;
+    std::cout << " \\\n  X(" << opNames[a] << ", " << opNames[b] << ", " << call(a) << ", " << call(b) << ")";
+  }
+  std::cout << "\n";
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Recompiles a ROM ahead of time with WriteAotModule() into C++ source,
+ * to be built into a shared library for --replay and --bench.
+ */
+int RunAot(char const* romFilename, char const* outFilename) {
+  MappedRom rom;
+  if (!OpenRom(romFilename, rom)) {
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream out(outFilename);
+  if (!out.is_open()) {
+    std::cerr << "Cannot write " << outFilename << "\n";
+    return EXIT_FAILURE;
+  }
+  std::shared_ptr<const RomImage> image = romImageCache.Get(rom.Data(), rom.Size());
+  size_t blocks = WriteAotModule(*image, romFilename, out);
+  out.close();
+  if (!out) {
+    std::cerr << "Cannot write " << outFilename << "\n";
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "blocks=" << blocks << "\n";
+  return EXIT_SUCCESS;
+}
+
+#if !defined(CHIP8_NO_MAIN)
+int main(int argc, char** argv) {
+  if (argc >= 3 && std::string(argv[1]) == "--batch") {
+    uint64_t threads = std::thread::hardware_concurrency();
+    if (argc >= 4 && !ParseArgument(argv[3], "Threads", UINT_MAX, threads)) {
+      return EXIT_FAILURE;
+    }
+    return RunBatch(argv[2], static_cast<unsigned int>(threads));
+  }
+  if ((argc == 3 || argc == 4) && std::string(argv[1]) == "--lanes-check") {
+    uint64_t frames = 600;
+    if (argc == 4 && !ParseArgument(argv[3], "Frames", UINT64_MAX, frames)) {
+      return EXIT_FAILURE;
+    }
+    return RunLanesCheck(argv[2], frames);
+  }
+  if (argc >= 2 && std::string(argv[1]) == "--selftest") {
+    return RunSelfTest(argv + 2, argc - 2);
+  }
+  if ((argc == 4 || argc == 5) && std::string(argv[1]) == "--replay") {
+    return RunReplay(argv[2], argv[3], argc == 5 ? argv[4] : nullptr);
+  }
+  if (argc >= 2 && argc <= 4 && std::string(argv[1]) == "--bench") {
+    return RunBench(argc >= 3 ? argv[2] : nullptr, argc == 4 ? argv[3] : nullptr);
+  }
+  if ((argc == 3 || argc == 4) && std::string(argv[1]) == "--reset-bench") {
+    uint64_t count = 1000000;
+    if (argc == 4 && !ParseArgument(argv[3], "Count", ULONG_MAX, count)) {
+      return EXIT_FAILURE;
+    }
+    return RunResetBench(argv[2], static_cast<unsigned long>(count));
+  }
+  if (argc >= 4 && std::string(argv[1]) == "--mine") {
+    uint64_t cycles;
+    if (!ParseArgument(argv[2], "Cycles", UINT64_MAX, cycles)) {
+      return EXIT_FAILURE;
+    }
+    return RunMine(cycles, argv + 3, argc - 3);
+  }
+  if (argc == 4 && std::string(argv[1]) == "--aot") {
+    return RunAot(argv[2], argv[3]);
+  }
+  if (argc >= 3 && std::string(argv[1]) == "--flag-bench") {
+    return RunFlagBench(argv + 2, argc - 2);
+  }
+
+#if defined(CHIP8_HEADLESS)
+  std::cerr << "Usage: " << argv[0] << " --batch <JobsFile> [Threads]\n"
+    << "       " << argv[0] << " --replay <ROM> <InputLog> [Module]\n"
+    << "       " << argv[0] << " --bench [ROM [Module]]\n"
+    << "       " << argv[0] << " --reset-bench <ROM> [Count]\n"
+    << "       " << argv[0] << " --mine <Cycles> <ROM>...\n"
+    << "       " << argv[0] << " --aot <ROM> <Source>\n"
+    << "       " << argv[0] << " --flag-bench <ROM>...\n"
+    << "       " << argv[0] << " --lanes-check <ROM> [Frames]\n"
+    << "       " << argv[0] << " --selftest [ROM...]\n";
+  return EXIT_FAILURE;
+#else
+  if (argc != 4 && argc != 5) {
+    std::cerr << "Usage: " << argv[0] << " <Scale> <InstructionsPerFrame> <ROM> [InputLog]\n"
+      << "       " << argv[0] << " --batch <JobsFile> [Threads]\n"
+      << "       " << argv[0] << " --replay <ROM> <InputLog> [Module]\n"
+      << "       " << argv[0] << " --bench [ROM [Module]]\n"
+      << "       " << argv[0] << " --reset-bench <ROM> [Count]\n"
+      << "       " << argv[0] << " --mine <Cycles> <ROM>...\n"
+      << "       " << argv[0] << " --aot <ROM> <Source>\n"
+      << "       " << argv[0] << " --flag-bench <ROM>...\n"
+      << "       " << argv[0] << " --lanes-check <ROM> [Frames]\n"
+      << "       " << argv[0] << " --selftest [ROM...]\n";
+    return EXIT_FAILURE;
+  }
+
+  // The window is VIDEO_WIDTH * Scale pixels wide, which has to fit in an int
+  uint64_t scale;
+  uint64_t rate;
+  if (!ParseArgument(argv[1], "Scale", INT_MAX / VIDEO_WIDTH, scale)
+    || !ParseArgument(argv[2], "InstructionsPerFrame", UINT_MAX, rate)) {
+    return EXIT_FAILURE;
+  }
+  int videoScale = static_cast<int>(scale);
+  unsigned int instructionsPerFrame = static_cast<unsigned int>(rate);
+  char const* romFilename = argv[3];
+  char const* logFilename = argc == 5 ? argv[4] : nullptr;
+
+  Platform platform("CHIP-8 Emulator", VIDEO_WIDTH * videoScale, VIDEO_HEIGHT * videoScale, VIDEO_WIDTH, VIDEO_HEIGHT);
+
+  MappedRom rom;
+  if (!OpenRom(romFilename, rom)) {
+    return EXIT_FAILURE;
+  }
+
+  uint64_t seed = std::chrono::system_clock::now().time_since_epoch().count();
+  std::unique_ptr<Chip8> machine = CreateChip8(rom.Data(), rom.Size(), seed);
+  Chip8& chip8 = *machine;
+
+  Scheduler scheduler(chip8, instructionsPerFrame);
+
+  // Record the session so --replay can run it again
+  InputLog log;
+  if (logFilename) {
+    log.seed = seed;
+    log.quirks = chip8.quirks;
+    log.instructionsPerFrame = instructionsPerFrame;
+    log.romHash = Fnv1a(rom.Data(), rom.Size());
+    scheduler.Record(&log);
+  }
+
+  // Holding Backspace steps back through the last minute, a frame per
+  // frame; a session being recorded has to run straight through to replay
+  RewindBuffer rewind;
+  bool rewindable = !logFilename;
+
+  bool quit = false;
+  uint64_t framesPresented = 0;
+  while (!quit) {
+    // Parked on Fx0A with the timers run down, nothing changes until a key
+    // comes in; afterwards frames are paced from now rather than caught up.
+    // Rewinding still steps back a frame per frame
+    if (!platform.RewindHeld() && scheduler.WaitingForKey() && !chip8.delayTimer && !chip8.soundTimer) {
+      platform.WaitForInput();
+      scheduler.SetThrottled(true);
+    }
+    quit = platform.ProcessInput(chip8.keyMask);
+
+    if (rewindable && platform.RewindHeld()) {
+      // The keypad stays the host's rather than the restored frame's
+      uint16_t keys = chip8.keyMask;
+      rewind.StepBack(chip8);
+      chip8.keyMask = keys;
+      scheduler.HoldFrame();
+    } else {
+      scheduler.RunFrame();
+      if (rewindable) {
+        rewind.Record(chip8);
+      }
+    }
+    framesPresented += platform.Update(chip8.display, chip8.dirtyRows);
+  }
+
+  // How many frames the dirty-row tracking kept from being uploaded and presented
+  std::cout << "frames_presented=" << framesPresented << " frames_skipped=" << platform.FramesSkipped() << "\n";
+
+  if (logFilename) {
+    log.frames = scheduler.Frames();
+    log.finalHash = StateHash(chip8);
+    if (!log.Save(logFilename)) {
+      std::cerr << "Cannot write input log " << logFilename << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  return 0;
+#endif
+}
+#endif
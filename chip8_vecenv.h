@@ -0,0 +1,64 @@
+/**
+ * C interface to the batched Gym-style environment in chip8.cpp: count
+ * CHIP-8 machines running the same ROM, stepped together and observed as
+ * one [count][32][64] byte tensor, for driving the emulator from a
+ * reinforcement learning trainer.
+ *
+ * Build it as a shared library, without the SDL front end or main():
+ *
+ *   c++ -std=c++17 -O2 -shared -fPIC -DCHIP8_HEADLESS -DCHIP8_NO_MAIN \
+ *     chip8.cpp -o libchip8.so -pthread -ldl
+ *
+ * then link against it, or load it with dlopen() or Python's ctypes.
+ */
+#ifndef CHIP8_VECENV_H
+#define CHIP8_VECENV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chip8_vecenv chip8_vecenv;
+
+//Why a ROM file could not be loaded
+typedef enum chip8_rom_error {
+  CHIP8_ROM_OK,
+  CHIP8_ROM_MISSING,     //Cannot be opened
+  CHIP8_ROM_NOT_REGULAR, //A FIFO, device or directory
+  CHIP8_ROM_TOO_BIG,     //More than 3584 bytes, the memory above 0x200
+  CHIP8_ROM_SHORT_READ   //Fewer bytes came in than the file holds
+} chip8_rom_error;
+
+/**
+ * Returns null if the ROM cannot be loaded or the environments could not
+ * be created. If error is not null, it is set to why the ROM could not be
+ * loaded, or to CHIP8_ROM_OK.
+ */
+chip8_vecenv* chip8_vecenv_create(char const* rom, size_t count, unsigned int instructionsPerFrame, uint64_t seed,
+  chip8_rom_error* error);
+
+//A description of error, worded to follow the ROM's filename
+const char* chip8_rom_error_string(chip8_rom_error error);
+
+void chip8_vecenv_destroy(chip8_vecenv* env);
+
+//Number of environments
+size_t chip8_vecenv_size(const chip8_vecenv* env);
+
+//Restart the environments where mask is non-zero, or all of them if mask is null
+void chip8_vecenv_reset(chip8_vecenv* env, const uint8_t* mask);
+
+//Hold key actions[i] (0-F, or -1 for none) on environment i for framesToSkip frames, then release it
+void chip8_vecenv_step(chip8_vecenv* env, const int8_t* actions, unsigned int framesToSkip);
+
+//Write every display into observations, size * 32 * 64 bytes, one byte (0 or 1) per pixel
+void chip8_vecenv_observe(const chip8_vecenv* env, uint8_t* observations);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif